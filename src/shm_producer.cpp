@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2017-2023, Stefan Haustein, Aaron Liu
+ *
+ *     This file is free software: you may copy, redistribute and/or modify it
+ *     under the terms of the GNU General Public License as published by the
+ *     Free Software Foundation, either version 3 of the License, or (at your
+ *     option) any later version.
+ *
+ *     This file is distributed in the hope that it will be useful, but
+ *     WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *     General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Alternatively, you may copy, redistribute and/or modify this file under
+ * the terms of the Apache License, version 2.0:
+ *
+ *     Licensed under the Apache License, Version 2.0 (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+// Sample producer for tiv --shm: publishes an animated test pattern to a
+// POSIX shared memory ring buffer until interrupted.
+//
+// usage: shm_producer <name> <width>x<height> [<fps>]
+//        tiv --shm <name>,<width>x<height>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include "tiv_shm.h"
+
+volatile std::sig_atomic_t interrupted = 0;
+
+int main(int argc, char *argv[]) {
+    int width, height;
+    if (argc < 3 || std::sscanf(argv[2], "%dx%d", &width, &height) != 2 ||
+        width <= 0 || height <= 0) {
+        std::cerr << "usage: shm_producer <name> <width>x<height> [<fps>]"
+                  << std::endl;
+        return 64;
+    }
+    double fps = argc > 3 ? std::atof(argv[3]) : 30;
+    if (!(fps > 0)) {
+        std::cerr << "shm_producer: <fps> must be greater than 0" << std::endl;
+        return 64;
+    }
+    const char *name = argv[1];
+    const uint32_t slots = 3;
+    // With a single slot, every frame would be overwritten while being read.
+    static_assert(slots >= 2, "readers need at least two slots");
+    const uint32_t stride = 3 * width;
+    const size_t frame_size = static_cast<size_t>(stride) * height;
+    const size_t total = TIV_SHM_DATA_OFFSET + slots * frame_size;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        std::perror("shm_producer");
+        return 71;
+    }
+    void *mapping =
+        mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::perror("shm_producer");
+        shm_unlink(name);
+        return 71;
+    }
+    TivShmHeader *header = new (mapping) TivShmHeader;
+    header->format = TIV_SHM_FORMAT_RGB24;
+    header->stride = stride;
+    header->slots = slots;
+    header->sequence.store(0);
+    header->magic = TIV_SHM_MAGIC;
+    unsigned char *data =
+        static_cast<unsigned char *>(mapping) + TIV_SHM_DATA_OFFSET;
+
+    std::signal(SIGINT, [](int) { interrupted = 1; });
+    std::signal(SIGTERM, [](int) { interrupted = 1; });
+    auto next = std::chrono::steady_clock::now();
+    for (uint64_t n = 0; !interrupted; n++) {
+        // A gradient background with a square bouncing around.
+        unsigned char *frame = data + (n % slots) * frame_size;
+        int size = std::max(std::min(width, height) / 4, 1);
+        int range_x = std::max(width - size, 1);
+        int range_y = std::max(height - size, 1);
+        int sx = std::abs(static_cast<int>(n * 5 % (2 * range_x)) - range_x);
+        int sy = std::abs(static_cast<int>(n * 3 % (2 * range_y)) - range_y);
+        for (int y = 0; y < height; y++) {
+            unsigned char *p = frame + y * stride;
+            for (int x = 0; x < width; x++, p += 3) {
+                bool square = x >= sx && x < sx + size && y >= sy &&
+                              y < sy + size;
+                p[0] = square ? 255 : 255 * x / width;
+                p[1] = square ? 220 : 255 * y / height;
+                p[2] = square ? 0 : (n * 2) & 255;
+            }
+        }
+        header->sequence.store(n + 1, std::memory_order_release);
+
+        next += std::chrono::microseconds(static_cast<long>(1e6 / fps));
+        std::this_thread::sleep_until(next);
+    }
+    munmap(mapping, total);
+    shm_unlink(name);
+    return 0;
+}
@@ -32,14 +32,33 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "tiv_gif.h"
 #include "tiv_lib.h"
+#include "tiv_shm.h"
 
 // This #define tells CImg that we use the library without any display options
 // -- just for loading images.
@@ -50,10 +69,37 @@
 #ifdef _POSIX_VERSION
 // Console output size detection
 #include <sys/ioctl.h>
+// Ignoring SIGPIPE, so a closed stdout is reported as a write error, and
+// catching SIGINT to restore the terminal
+#include <csignal>
+// Memory mapped input files
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// Decoding stdin through ImageMagick without temporary files
+#include <spawn.h>
+#include <sys/wait.h>
+// Querying the terminal for synchronized update support
+#include <poll.h>
+#include <termios.h>
 // Error explanation, for some reason
 #include <cstring>
 #endif
 
+#ifdef __linux__
+// CPU affinity mask for the default thread count
+#include <sched.h>
+// Watching files for changes
+#include <sys/inotify.h>
+// Reading ahead through io_uring, without depending on liburing
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define TIV_IO_URING
+#endif
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 // Error explanation
@@ -66,6 +112,7 @@ constexpr int FLAG_BG = 2;
 constexpr int FLAG_MODE_256 = 4;   // Limit colors to 256-color mode
 constexpr int FLAG_24BIT = 8;      // 24-bit color mode
 constexpr int FLAG_NOOPT = 16;     // Only use the same half-block character
+constexpr int FLAG_STATS = 64;     // Report output statistics of videos
 
 // Program exit code constants compatible with sysexits.h.
 #define EXITCODE_OK 0
@@ -73,173 +120,3545 @@ constexpr int FLAG_NOOPT = 16;     // Only use the same half-block character
 #define EXITCODE_DATA_FORMAT_ERROR 65
 #define EXITCODE_NO_INPUT_ERROR 66
 
-inline double sqr(double n) { return n * n; }
+inline double sqr(double n) { return n * n; }
+
+// Set once writing to stdout has failed, e.g. because the reading end of a
+// pipe was closed (tiv dir | head). Pending decode and render work checks
+// this and bails out instead of producing output nobody will see.
+std::atomic<bool> output_closed(false);
+
+// Returns false if stdout has been closed, flagging pending work to stop.
+bool output_ok() {
+    if (!std::cout) output_closed = true;
+    return !output_closed;
+}
+
+// Returns the closest color of the 256 color palette.
+int color_index_256(int r, int g, int b) {
+    r = clamp_byte(r);
+    g = clamp_byte(g);
+    b = clamp_byte(b);
+
+    int ri = best_index(r, COLOR_STEPS, COLOR_STEP_COUNT);
+    int gi = best_index(g, COLOR_STEPS, COLOR_STEP_COUNT);
+    int bi = best_index(b, COLOR_STEPS, COLOR_STEP_COUNT);
+
+    int rq = COLOR_STEPS[ri];
+    int gq = COLOR_STEPS[gi];
+    int bq = COLOR_STEPS[bi];
+
+    int gray =
+        static_cast<int>(std::round(r * 0.2989f + g * 0.5870f + b * 0.1140f));
+
+    int gri = best_index(gray, GRAYSCALE_STEPS, GRAYSCALE_STEP_COUNT);
+    int grq = GRAYSCALE_STEPS[gri];
+
+    if (0.3 * sqr(rq - r) + 0.59 * sqr(gq - g) + 0.11 * sqr(bq - b) <
+        0.3 * sqr(grq - r) + 0.59 * sqr(grq - g) + 0.11 * sqr(grq - b)) {
+        return 16 + 36 * ri + 6 * gi + bi;
+    }
+    return 232 + gri;  // 1..24 -> 232..255
+}
+
+void printTermColor(std::string &out, const int &flags, int r, int g,
+                    int b) {
+    r = clamp_byte(r);
+    g = clamp_byte(g);
+    b = clamp_byte(b);
+
+    bool bg = (flags & FLAG_BG) != 0;
+
+    if ((flags & FLAG_MODE_256) == 0) {
+        out += bg ? "\x1b[48;2;" : "\x1b[38;2;";
+        out += std::to_string(r) + ';' + std::to_string(g) + ';' +
+               std::to_string(b) + 'm';
+        return;
+    }
+
+    int color_index = color_index_256(r, g, b);
+    out += bg ? "\x1B[48;5;" : "\u001B[38;5;";
+    out += std::to_string(color_index) + 'm';
+}
+
+void printCodepoint(std::string &out, int codepoint) {
+    if (codepoint == 0) {
+        out += ' ';  // A cell that was never rendered; NUL would not advance
+    } else if (codepoint < 128) {
+        out += static_cast<char>(codepoint);
+    } else if (codepoint < 0x7ff) {
+        out += static_cast<char>(0xc0 | (codepoint >> 6));
+        out += static_cast<char>(0x80 | (codepoint & 0x3f));
+    } else if (codepoint < 0xffff) {
+        out += static_cast<char>(0xe0 | (codepoint >> 12));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (codepoint & 0x3f));
+    } else if (codepoint < 0x10ffff) {
+        out += static_cast<char>(0xf0 | (codepoint >> 18));
+        out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (codepoint & 0x3f));
+    } else {
+        std::cerr << "ERROR";
+    }
+}
+
+// Appends the output for a row of cells, followed by a color reset.
+void printCells(std::string &out, const CharData *cells, int count,
+                const int &flags) {
+    for (int x = 0; x < count; x++) {
+        const CharData &charData = cells[x];
+        if (x == 0 || charData.bgColor != cells[x - 1].bgColor)
+            printTermColor(out, flags | FLAG_BG, charData.bgColor[0],
+                           charData.bgColor[1], charData.bgColor[2]);
+        if (x == 0 || charData.fgColor != cells[x - 1].fgColor)
+            printTermColor(out, flags | FLAG_FG, charData.fgColor[0],
+                           charData.fgColor[1], charData.fgColor[2]);
+        printCodepoint(out, charData.codePoint);
+    }
+    out += "\x1b[0m";
+}
+
+// Whether two cells are shown the same with the colors of the terminal.
+bool looksSame(const CharData &a, const CharData &b, const int &flags) {
+    if (!(flags & FLAG_MODE_256) || a.codePoint != b.codePoint) return a == b;
+    auto index = [](const std::array<int, 3> &color) {
+        return color_index_256(color[0], color[1], color[2]);
+    };
+    return index(a.fgColor) == index(b.fgColor) &&
+           index(a.bgColor) == index(b.bgColor);
+}
+
+// Unchanged cells between two changed ones are printed again instead of
+// moving the cursor over them if there are at most this many, which is
+// about what moving and setting the colors again costs.
+constexpr int MAX_REPRINTED_CELLS = 4;
+
+// Calls print(x, end) for each run of cells in a row that differ from those
+// shown, from x up to (excluding) end, joining runs that are close.
+template <typename Print>
+void forEachChangedRun(const CharData *row, const CharData *shown, int count,
+                       const int &flags, Print print) {
+    int x = 0;
+    while (true) {
+        while (x < count && looksSame(row[x], shown[x], flags)) x++;
+        if (x == count) break;
+        int end = x + 1;
+        for (int next = end; next < count && next - end <= MAX_REPRINTED_CELLS;
+             next++) {
+            if (!looksSame(row[next], shown[next], flags)) end = next + 1;
+        }
+        print(x, end);
+        x = end;
+    }
+}
+
+// Finds the character and colors for the 4x8 pixel cell at x, y.
+template <typename GetPixel>
+CharData renderCell(const GetPixel &get_pixel, int x, int y,
+                    const int &flags) {
+    return flags & FLAG_NOOPT
+               ? createCharData(get_pixel, x, y, 0x2584, 0x0000ffff)
+               : findCharData(get_pixel, x, y, flags);
+}
+
+// A hash of the 4x8 pixels of the cell at x, y; never 0.
+uint64_t hashCell(const PixelView &view, int x, int y) {
+    uint64_t hash = 0x9e3779b97f4a7c15;
+    const unsigned char *row = view.data + y * view.stride + x * 3;
+    for (int i = 0; i < 8; i++, row += view.stride) {
+        uint64_t left;  // 12 bytes per row
+        uint32_t right;
+        std::memcpy(&left, row, sizeof(left));
+        std::memcpy(&right, row + sizeof(left), sizeof(right));
+        hash = (hash ^ left) * 0xff51afd7ed558ccd;
+        hash ^= hash >> 32;
+        hash = (hash ^ right) * 0xc4ceb9fe1a85ec53;
+        hash ^= hash >> 29;
+    }
+    return hash | 1;
+}
+
+// Finds the cells of the row of an image starting at pixel row y.
+void renderRow(const cimg_library::CImg<unsigned char> &image, int y,
+               const int &flags, std::vector<CharData> &row) {
+    GetPixelFunction get_pixel = [&](int x, int y) -> unsigned long {
+        return (((unsigned long) image(x, y, 0, 0)) << 16)
+            | (((unsigned long) image(x, y, 0, 1)) << 8)
+            | (((unsigned long) image(x, y, 0, 2)));
+    };
+
+    row.resize(image.width() / 4);
+    for (size_t x = 0; x < row.size(); x++)
+        row[x] = renderCell(get_pixel, x * 4, y, flags);
+}
+
+void printImage(const cimg_library::CImg<unsigned char> &image,
+                const int &flags) {
+    std::vector<CharData> row;
+    std::string out;
+    for (int y = 0; y <= image.height() - 8; y += 8) {
+        renderRow(image, y, flags, row);
+        out.clear();
+        printCells(out, row.data(), row.size(), flags);
+        std::cout << out << std::endl;
+        if (!output_ok()) return;
+    }
+}
+
+// Appends the rows of cells showing an image to out, separated by newlines.
+void renderImage(std::string &out,
+                 const cimg_library::CImg<unsigned char> &image,
+                 const int &flags) {
+    std::vector<CharData> row;
+    for (int y = 0; y <= image.height() - 8; y += 8) {
+        renderRow(image, y, flags, row);
+        if (y > 0) out += '\n';
+        printCells(out, row.data(), row.size(), flags);
+    }
+}
+
+struct size {
+    size(unsigned int in_width, unsigned int in_height)
+        : width(in_width), height(in_height) {}
+    explicit size(cimg_library::CImg<unsigned int> img)
+        : width(img.width()), height(img.height()) {}
+    unsigned int width;
+    unsigned int height;
+    size scaled(double scale) { return size(width * scale, height * scale); }
+    size fitted_within(size container) {
+        double scale = std::min(container.width / static_cast<double>(width),
+                                container.height / static_cast<double>(height));
+        return scaled(scale);
+    }
+};
+std::ostream &operator<<(std::ostream &stream, size sz) {
+    stream << sz.width << "x" << sz.height;
+    return stream;
+}
+
+enum ImageFormat {
+    FORMAT_UNKNOWN,
+    FORMAT_PNG,
+    FORMAT_JPEG,
+    FORMAT_GIF,
+    FORMAT_BMP,
+    FORMAT_PNM,
+    FORMAT_TIFF,
+    FORMAT_WEBP,
+    FORMAT_OTHER  // Recognized, but only decodable via ImageMagick
+};
+
+// Number of leading bytes sniff_format() needs to identify a format.
+constexpr size_t SNIFF_SIZE = 16;
+
+/**
+ * @brief Identify an image format from the first bytes of a file
+ *
+ * @param data The first bytes of the file
+ * @param length The number of bytes available, up to SNIFF_SIZE
+ * @return ImageFormat FORMAT_UNKNOWN if this is not a known image format
+ */
+ImageFormat sniff_format(const unsigned char *data, size_t length) {
+    // Takes a string literal, which may contain NUL bytes.
+    auto starts_with = [&](const auto &magic, size_t offset = 0) {
+        size_t n = sizeof(magic) - 1;
+        return length >= offset + n && !std::memcmp(data + offset, magic, n);
+    };
+    if (starts_with("\x89PNG\r\n\x1a\n")) return FORMAT_PNG;
+    if (starts_with("\xff\xd8\xff")) return FORMAT_JPEG;
+    if (starts_with("GIF87a") || starts_with("GIF89a")) return FORMAT_GIF;
+    if (starts_with("BM")) return FORMAT_BMP;
+    if (length >= 3 && data[0] == 'P' && data[1] >= '1' && data[1] <= '6' &&
+        std::isspace(data[2]))
+        return FORMAT_PNM;
+    if (starts_with("II*") || starts_with("MM")) {
+        if (length >= 4 && (data[2] | data[3]) == 42) return FORMAT_TIFF;
+    }
+    if (starts_with("RIFF") && starts_with("WEBP", 8)) return FORMAT_WEBP;
+    if (starts_with("8BPS") || starts_with("\xff\x0a") ||
+        starts_with("\x00\x00\x01\x00") ||  // ICO
+        (starts_with("ftyp", 4) &&
+         (starts_with("heic", 8) || starts_with("heix", 8) ||
+          starts_with("mif1", 8) || starts_with("avif", 8))) ||
+        starts_with("\x00\x00\x00\x0cJXL "))
+        return FORMAT_OTHER;
+    return FORMAT_UNKNOWN;
+}
+
+/**
+ * @brief Convert a decoded image to 3 channels (RGB)
+ *
+ * @param image The decoded image with 1, 3 or 4 channels
+ * @param bgColor  The background color in case of a transparent image
+ * @return cimg_library::CImg<unsigned char> The RGB image
+ */
+cimg_library::CImg<unsigned char> to_rgb_CImg(
+    cimg_library::CImg<unsigned char> image, unsigned char *bgColor) {
+    // Regular image, do nothing special
+    if (image.spectrum() == 3) {
+        if (!(bgColor[0] == 255 && bgColor[1] == 255 && bgColor[2] == 255)) {
+          std::cerr << "Warning: Background color argument '-C' was specified, "
+                       "but only PNGs and GIFs transparencies are supported "
+                       "at the moment. Using white background instead."
+              << std::endl;
+        }
+        return image;
+    }
+
+    cimg_library::CImg<unsigned char> rgb_image(
+        image.width(), image.height(), image.depth(), 3);
+
+    if (image.spectrum() == 1) {
+        // Greyscale. Just copy greyscale data to all channels
+        for (unsigned int chn = 0; chn < 3; chn++)
+            rgb_image.draw_image(0, 0, 0, chn, image);
+    } else if (image.spectrum() == 4) {
+        // Transparent image, fill background then draw image over
+        for (unsigned int chn = 0; chn < 3; chn++)
+            rgb_image.get_shared_channel(chn).fill(bgColor[chn]);
+        rgb_image.draw_image(0, 0, image.get_shared_channels(0, 2),
+                image.get_shared_channel(3), 1, 255);
+    }
+    return rgb_image;
+}
+
+/**
+ * @brief Wrapper around CImg<T>(const char*) constructor
+ * that always returns a CImg image with 3 channels (RGB)
+ *
+ * @param filename The file to construct a CImg object on
+ * @param bgColor  The color to use as the background in case of a transparent image
+ * @return cimg_library::CImg<unsigned char> Constructed CImg RGB image
+ */
+cimg_library::CImg<unsigned char> load_rgb_CImg(const char *const &filename,
+                                                unsigned char* bgColor) {
+    return to_rgb_CImg(cimg_library::CImg<unsigned char>(filename), bgColor);
+}
+
+#ifdef _POSIX_VERSION
+extern char **environ;  // For posix_spawnp()
+
+// Creates a pipe whose ends are not inherited by spawned processes. Where
+// pipe2() exists, no decoder spawned on another thread in the meantime can
+// inherit them either.
+bool pipe_cloexec(int fds[2]) {
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__)
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (pipe(fds) != 0) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+/**
+ * @brief Decode an image in memory with ImageMagick, streaming it through
+ * pipes instead of temporary files.
+ *
+ * @param data The encoded image
+ * @param length The size of the encoded image
+ * @return cimg_library::CImg<unsigned char> The decoded image
+ */
+cimg_library::CImg<unsigned char> load_external(const unsigned char *data,
+                                                size_t length) {
+    int in[2], out[2];
+    // Keep our ends from leaking into concurrently spawned decoders.
+    if (!pipe_cloexec(in)) {
+        throw cimg_library::CImgIOException("load_external(): pipe failed");
+    }
+    if (!pipe_cloexec(out)) {
+        close(in[0]), close(in[1]);
+        throw cimg_library::CImgIOException("load_external(): pipe failed");
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    pid_t pid = -1;
+    for (const char *command : {"magick", "convert"}) {
+        const char *args[] = {command, "-", "png:-", nullptr};
+        if (posix_spawnp(&pid, command, &actions, nullptr,
+                         const_cast<char *const *>(args), environ) == 0)
+            break;
+        pid = -1;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]), close(out[1]);
+
+    // Feed the input from a separate thread, as ImageMagick may start
+    // writing its output before it has consumed all of it.
+    std::thread writer([&] {
+        for (size_t done = 0; pid != -1 && done < length;) {
+            ssize_t n = write(in[1], data + done, length - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        close(in[1]);
+    });
+    cimg_library::CImg<unsigned char> image;
+    std::FILE *file = fdopen(out[0], "rb");
+    bool loaded = false;
+    if (file && pid != -1) {
+        const unsigned int omode = cimg_library::cimg::exception_mode();
+        cimg_library::cimg::exception_mode(0);
+        try {
+            image.load_png(file);
+            loaded = true;
+        } catch (cimg_library::CImgException &) {
+        }
+        cimg_library::cimg::exception_mode(omode);
+    }
+    file ? std::fclose(file) : close(out[0]);
+    writer.join();
+    if (pid != -1) waitpid(pid, nullptr, 0);
+    if (!loaded) {
+        throw cimg_library::CImgIOException(
+            "load_external(): Failed to decode data with ImageMagick");
+    }
+    return image;
+}
+#endif
+
+/**
+ * @brief Like load_rgb_CImg(filename, bgColor), but decodes PNG, PNM and BMP
+ * images directly from the file contents in memory. Other formats are loaded
+ * by file name, which then usually hits the page cache, or streamed through
+ * ImageMagick if there is no file (stdin).
+ *
+ * @param data The contents of the file
+ * @param length The size of the contents, 0 if the file could not be read
+ * @param filename The file the data was read from, nullptr for stdin
+ * @param bgColor  The background color in case of a transparent image
+ * @return cimg_library::CImg<unsigned char> Constructed CImg RGB image
+ */
+cimg_library::CImg<unsigned char> load_rgb_CImg(
+    const unsigned char *data, size_t length, const char *const &filename,
+    unsigned char *bgColor) {
+#ifdef _POSIX_VERSION
+    ImageFormat format = sniff_format(data, length);
+    std::FILE *file =
+        format == FORMAT_PNG || format == FORMAT_PNM || format == FORMAT_BMP
+            ? fmemopen(const_cast<unsigned char *>(data), length, "rb")
+            : nullptr;
+    if (file) {
+        cimg_library::CImg<unsigned char> image;
+        try {
+            if (format == FORMAT_PNG) {
+                image.load_png(file);
+            } else if (format == FORMAT_PNM) {
+                image.load_pnm(file);
+            } else {
+                image.load_bmp(file);
+            }
+        } catch (...) {
+            std::fclose(file);
+            throw;
+        }
+        std::fclose(file);
+        return to_rgb_CImg(std::move(image), bgColor);
+    }
+    if (!filename) {
+        return to_rgb_CImg(load_external(data, length), bgColor);
+    }
+#endif
+    return load_rgb_CImg(filename, bgColor);
+}
+
+/**
+ * @brief Read-only contents of a file, memory mapped where possible.
+ *
+ * The same mapping serves format sniffing and decoding, so each file is
+ * opened once and its data is not copied into a separate buffer. Pipes and
+ * other streams (including stdin, named "-") are read into memory instead.
+ */
+class FileData {
+ public:
+    explicit FileData(const std::string &filename) {
+#ifdef _POSIX_VERSION
+        int fd = filename == "-" ? STDIN_FILENO
+                                 : open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0) return;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *mapping =
+                mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+                data_ = static_cast<const unsigned char *>(mapping);
+                size_ = st.st_size;
+                mapped_ = true;
+            }
+        }
+        while (!mapped_) {
+            size_t done = buffer_.size();
+            buffer_.resize(std::max<size_t>(2 * done, 65536));
+            ssize_t n = read(fd, buffer_.data() + done, buffer_.size() - done);
+            buffer_.resize(done + std::max<ssize_t>(n, 0));
+            if (n == 0 || (n < 0 && errno != EINTR)) break;
+        }
+        if (fd != STDIN_FILENO) close(fd);
+#else
+        std::ifstream file(filename, std::ios::binary);
+        std::istream &in = filename == "-" ? std::cin : file;
+        buffer_.assign(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+#endif
+        if (!mapped_) {
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+        }
+    }
+
+    // Takes over contents that were read elsewhere, e.g. by a ReadRing.
+    explicit FileData(std::vector<unsigned char> buffer)
+        : buffer_(std::move(buffer)) {
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
+
+    ~FileData() {
+#ifdef _POSIX_VERSION
+        if (mapped_) munmap(const_cast<unsigned char *>(data_), size_);
+#endif
+    }
+
+    FileData(const FileData &) = delete;
+    FileData &operator=(const FileData &) = delete;
+
+    // Asks the kernel to start reading the whole file in the background.
+    void prefetch() const {
+#ifdef _POSIX_VERSION
+        if (mapped_)
+            madvise(const_cast<unsigned char *>(data_), size_, MADV_WILLNEED);
+#endif
+    }
+
+    const unsigned char *data() const { return data_; }
+    size_t size() const { return size_; }  // 0 if the file can't be read
+
+ private:
+    const unsigned char *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<unsigned char> buffer_;
+};
+
+#ifdef TIV_IO_URING
+/**
+ * @brief Reads whole files ahead of their use through one io_uring instance.
+ *
+ * Reads are submitted from the caller's thread and completed on a thread of
+ * their own, so many files can be in flight at once without a thread (or a
+ * blocking page fault on a mapping) per file. The kernel interface is used
+ * through raw system calls. Kernels without io_uring, or sandboxes that
+ * forbid it, make ok() return false; read() also returns no future for
+ * files it can't handle, and the caller falls back to FileData then.
+ */
+class ReadRing {
+ public:
+    explicit ReadRing(unsigned int entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ < 0) return;
+        entries_ = params.sq_entries;
+        sq_size_ = params.sq_off.array + entries_ * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes +
+                   params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size_ = entries_ * sizeof(io_uring_sqe);
+        sq_ = map(sq_size_, IORING_OFF_SQ_RING);
+        cq_ = map(cq_size_, IORING_OFF_CQ_RING);
+        void *sqes = map(sqes_size_, IORING_OFF_SQES);
+        if (!sq_ || !cq_ || !sqes) return;
+        sq_head_ = ring<unsigned>(sq_, params.sq_off.head);
+        sq_tail_ = ring<unsigned>(sq_, params.sq_off.tail);
+        sq_mask_ = *ring<unsigned>(sq_, params.sq_off.ring_mask);
+        sq_array_ = ring<unsigned>(sq_, params.sq_off.array);
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+        cq_head_ = ring<unsigned>(cq_, params.cq_off.head);
+        cq_tail_ = ring<unsigned>(cq_, params.cq_off.tail);
+        cq_mask_ = *ring<unsigned>(cq_, params.cq_off.ring_mask);
+        cqes_ = ring<io_uring_cqe>(cq_, params.cq_off.cqes);
+        completer_ = std::thread(&ReadRing::complete, this);
+    }
+
+    // Waits for the reads in flight, whose buffers are owned here.
+    ~ReadRing() {
+        if (completer_.joinable()) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stopping_ = true;
+            io_uring_sqe *sqe = next_sqe();
+            if (sqe) {
+                sqe->opcode = IORING_OP_NOP;
+                submit();
+            }
+            lock.unlock();
+            completer_.join();
+        }
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (cq_) munmap(cq_, cq_size_);
+        if (sq_) munmap(sq_, sq_size_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    ReadRing(const ReadRing &) = delete;
+    ReadRing &operator=(const ReadRing &) = delete;
+
+    bool ok() const { return completer_.joinable(); }
+
+    /**
+     * @brief Starts reading a regular file into memory.
+     *
+     * @param filename The file
+     * @return The contents once read, or no (invalid) future if the file is
+     *         not a regular one or the ring is full
+     */
+    std::future<std::unique_ptr<FileData>> read(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0) return {};
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+            close(fd);
+            return {};
+        }
+        auto request = std::make_unique<Request>();
+        request->filename = filename;
+        request->fd = fd;
+        request->buffer.resize(st.st_size);
+        auto contents = request->promise.get_future();
+        std::lock_guard<std::mutex> lock(mutex_);
+        // One entry stays free for the NOP that stops the completer.
+        uint64_t id = next_id_++;
+        if (requests_.size() + 1 >= entries_ || !submitRead(id, *request)) {
+            close(fd);
+            return {};
+        }
+        requests_.emplace(id, std::move(request));
+        return contents;
+    }
+
+ private:
+    struct Request {
+        std::string filename;
+        int fd;
+        std::vector<unsigned char> buffer;
+        size_t done = 0;  // Bytes read so far
+        iovec iov;
+        std::promise<std::unique_ptr<FileData>> promise;
+    };
+
+    void *map(size_t length, off_t offset) {
+        void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return mapping == MAP_FAILED ? nullptr : mapping;
+    }
+
+    template <typename T>
+    static T *ring(void *base, unsigned int offset) {
+        return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+    }
+
+    // Returns a cleared submission queue entry, or nullptr if the queue is
+    // full. Called with mutex_ held.
+    io_uring_sqe *next_sqe() {
+        unsigned int tail = *sq_tail_;
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries_)
+            return nullptr;
+        unsigned int index = tail & sq_mask_;
+        sq_array_[index] = index;
+        memset(&sqes_[index], 0, sizeof(io_uring_sqe));
+        return &sqes_[index];
+    }
+
+    // Publishes the entry returned by next_sqe(), along with any earlier one
+    // a failed io_uring_enter left behind. Called with mutex_ held.
+    bool submit() {
+        unsigned int tail = *sq_tail_ + 1;
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+        unsigned int queued =
+            tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        return syscall(__NR_io_uring_enter, fd_, queued, 0, 0, nullptr, 0) >=
+               0;
+    }
+
+    // Queues a read of the rest of the request's file. Called with mutex_
+    // held.
+    bool submitRead(uint64_t id, Request &request) {
+        io_uring_sqe *sqe = next_sqe();
+        if (!sqe) return false;
+        request.iov.iov_base = request.buffer.data() + request.done;
+        request.iov.iov_len = request.buffer.size() - request.done;
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = request.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&request.iov);
+        sqe->len = 1;
+        sqe->off = request.done;
+        sqe->user_data = id;
+        return submit();
+    }
+
+    // Runs on completer_: hands out the files whose reads have completed,
+    // continuing short ones, until stopped with nothing left in flight.
+    void complete() {
+        while (true) {
+            unsigned int head = *cq_head_;
+            if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (stopping_ && requests_.empty()) return;
+                }
+                syscall(__NR_io_uring_enter, fd_, 0, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0);
+                continue;
+            }
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto it = requests_.find(cqe.user_data);
+            if (it == requests_.end()) continue;  // The NOP from ~ReadRing
+            Request &request = *it->second;
+            if (cqe.res > 0) request.done += cqe.res;
+            if ((cqe.res > 0 && request.done < request.buffer.size()) ||
+                cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                if (submitRead(cqe.user_data, request)) continue;
+                cqe.res = -EIO;
+            }
+            std::unique_ptr<Request> done = std::move(it->second);
+            requests_.erase(it);
+            lock.unlock();
+            close(done->fd);
+            if (cqe.res < 0) {
+                // E.g. a file system that io_uring can't read from.
+                done->promise.set_value(
+                    std::make_unique<FileData>(done->filename));
+            } else {
+                done->buffer.resize(done->done);  // Truncated meanwhile
+                done->promise.set_value(
+                    std::make_unique<FileData>(std::move(done->buffer)));
+            }
+        }
+    }
+
+    int fd_ = -1;
+    unsigned int entries_ = 0;
+    size_t sq_size_ = 0, cq_size_ = 0, sqes_size_ = 0;
+    void *sq_ = nullptr;
+    void *cq_ = nullptr;
+    io_uring_sqe *sqes_ = nullptr;
+    unsigned int *sq_head_, *sq_tail_, *sq_array_;
+    unsigned int sq_mask_;
+    unsigned int *cq_head_, *cq_tail_;
+    unsigned int cq_mask_;
+    io_uring_cqe *cqes_;
+
+    std::mutex mutex_;  // Guards the submission queue and requests_
+    std::unordered_map<uint64_t, std::unique_ptr<Request>> requests_;
+    uint64_t next_id_ = 1;
+    bool stopping_ = false;
+    std::thread completer_;
+};
+#endif
+
+/**
+ * @brief Copy part of a decoded RGB image, which keeps each channel in a
+ * plane of its own, to packed 8-bit pixels
+ *
+ * @param image The image
+ * @param x0 The left edge of the part
+ * @param y0 The top edge of the part
+ * @param width The width of the part
+ * @param height The height of the part
+ * @param out Receives the pixels, starting with the top left one
+ * @param stride The distance between the starts of two rows in out in bytes
+ */
+void packPixels(const cimg_library::CImg<unsigned char> &image, int x0,
+                int y0, int width, int height, unsigned char *out,
+                size_t stride) {
+    for (int y = 0; y < height; y++, out += stride) {
+        const unsigned char *r = image.data(x0, y0 + y, 0, 0);
+        const unsigned char *g = image.data(x0, y0 + y, 0, 1);
+        const unsigned char *b = image.data(x0, y0 + y, 0, 2);
+        for (int x = 0; x < width; x++) {
+            out[3 * x] = r[x];
+            out[3 * x + 1] = g[x];
+            out[3 * x + 2] = b[x];
+        }
+    }
+}
+
+/**
+ * @brief Number of worker threads to use unless overridden with -j or
+ * TIV_THREADS.
+ *
+ * On Linux this honors the CPU affinity mask and the cgroup v2 CPU quota
+ * (cpu.max) of the process and all its parent groups, so a container that is
+ * limited to two CPUs on a 128 core host does not get 128 threads.
+ */
+unsigned int default_thread_count() {
+    unsigned int count = std::thread::hardware_concurrency();
+#ifdef __linux__
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        count = CPU_COUNT(&cpus);
+    }
+    // cgroup v2 lists the group as "0::<path>"; cpu.max contains
+    // "<quota> <period>" or "max <period>" if unlimited.
+    std::ifstream cgroup("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroup, line)) {
+        if (line.rfind("0::", 0) != 0) continue;
+        const std::filesystem::path root("/sys/fs/cgroup");
+        std::string group = line.substr(3);
+        std::filesystem::path dir = root.string() + (group == "/" ? "" : group);
+        while (true) {
+            std::ifstream cpu_max(dir / "cpu.max");
+            std::string quota;
+            long period;
+            if (cpu_max >> quota >> period && quota != "max" && period > 0) {
+                long limit = (std::stol(quota) + period - 1) / period;
+                count = std::min(count, static_cast<unsigned int>(limit));
+            }
+            if (dir == root || dir.string().size() < root.string().size())
+                break;
+            dir = dir.parent_path();
+        }
+    }
+#endif
+    return std::max(count, 1u);
+}
+
+/**
+ * @brief Walks directory trees on a pool of threads, handing out the image
+ * files found through a bounded queue.
+ *
+ * Files are identified by sniffing their first bytes, so non-images never
+ * reach the decoders (and never cost an ImageMagick process). The order of
+ * the files is not defined.
+ */
+class DirectoryWalker {
+ public:
+    DirectoryWalker(const std::vector<std::string> &roots,
+                    unsigned int threads)
+        : directories_(roots.begin(), roots.end()) {
+        for (unsigned int i = 0; i < threads; i++)
+            workers_.emplace_back(&DirectoryWalker::walk, this);
+    }
+
+    ~DirectoryWalker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled_ = true;
+        }
+        changed_.notify_all();
+        for (auto &worker : workers_) worker.join();
+    }
+
+    // Blocks until the next image file is found; false when done. The file
+    // is handed out along with the mapping used to identify it.
+    bool next(std::string &name, std::unique_ptr<FileData> &file) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return !found_.empty() || done(); });
+        if (found_.empty()) return false;
+        name = std::move(found_.front().first);
+        file = std::move(found_.front().second);
+        found_.pop_front();
+        changed_.notify_all();
+        return true;
+    }
+
+    // Whether next() returns without waiting for more files to be found.
+    bool ready() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !found_.empty() || done();
+    }
+
+    // Whether next() has handed out all files.
+    bool finished() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return found_.empty() && done();
+    }
+
+ private:
+    // Bounds the number of files found ahead of the consumer.
+    static constexpr size_t MAX_FOUND = 256;
+
+    bool done() { return cancelled_ || (directories_.empty() && busy_ == 0); }
+
+    void walk() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            changed_.wait(lock,
+                          [&] { return !directories_.empty() || done(); });
+            if (done()) break;
+            std::filesystem::path dir = std::move(directories_.front());
+            directories_.pop_front();
+            busy_++;
+            lock.unlock();
+
+            std::error_code error;
+            for (std::filesystem::directory_iterator it(dir, error), end;
+                 !error && it != end && !cancelled_; it.increment(error)) {
+                // Symbolic links to directories are not followed, to avoid
+                // cycles.
+                auto status = it->symlink_status(error);
+                if (std::filesystem::is_directory(status)) {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    directories_.push_back(it->path());
+                    changed_.notify_all();
+                } else if (std::filesystem::is_regular_file(
+                               it->status(error))) {
+                    std::string name = it->path().string();
+                    auto file = std::make_unique<FileData>(name);
+                    if (sniff_format(file->data(),
+                                     std::min(file->size(), SNIFF_SIZE)) ==
+                        FORMAT_UNKNOWN)
+                        continue;
+                    std::unique_lock<std::mutex> guard(mutex_);
+                    changed_.wait(guard, [&] {
+                        return found_.size() < MAX_FOUND || cancelled_;
+                    });
+                    found_.emplace_back(std::move(name), std::move(file));
+                    changed_.notify_all();
+                }
+            }
+
+            lock.lock();
+            busy_--;
+            changed_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::filesystem::path> directories_;
+    std::deque<std::pair<std::string, std::unique_ptr<FileData>>> found_;
+    unsigned int busy_ = 0;  // Number of directories being listed
+    // Also checked between the entries of a directory, without the lock
+    std::atomic<bool> cancelled_{false};
+    std::vector<std::thread> workers_;
+};
+
+/**
+ * @brief Reads file names from stdin, separated by a delimiter, telling
+ * whether the next one has arrived already
+ *
+ * This lets the thumbnail loop start on the names it has without waiting for
+ * a slow producer to write the next ones.
+ */
+class NameReader {
+ public:
+    explicit NameReader(char delimiter) : delimiter_(delimiter) {}
+
+    // Blocks until the next non-empty name is read; false at the end of
+    // stdin.
+    bool next(std::string &name) {
+        while (true) {
+            size_t end = pending_.find(delimiter_);
+            if (end != std::string::npos) {
+                name = pending_.substr(0, end);
+                pending_.erase(0, end + 1);
+                if (name.empty()) continue;
+                return true;
+            }
+            if (eof_) {
+                name = std::move(pending_);
+                pending_.clear();
+                return !name.empty();
+            }
+            fill();
+        }
+    }
+
+    // Whether next() returns without waiting for more input.
+    bool ready() {
+#ifdef _POSIX_VERSION
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        while (!eof_ && pending_.find(delimiter_) == std::string::npos &&
+               poll(&input, 1, 0) > 0)
+            fill();
+        return eof_ || pending_.find(delimiter_) != std::string::npos;
+#else
+        return true;
+#endif
+    }
+
+ private:
+    void fill() {
+#ifdef _POSIX_VERSION
+        char buffer[4096];
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n > 0) {
+            pending_.append(buffer, n);
+        } else if (n == 0 || errno != EINTR) {
+            eof_ = true;
+        }
+#else
+        std::string line;
+        if (std::getline(std::cin, line, delimiter_)) {
+            pending_ += line + delimiter_;
+        } else {
+            eof_ = true;
+        }
+#endif
+    }
+
+    char delimiter_;
+    std::string pending_;  // Read, but not handed out yet
+    bool eof_ = false;
+};
+
+/**
+ * @brief Scale packed 8-bit pixels with a box filter, averaging all source
+ * pixels that fall onto each target pixel (or picking the nearest one when
+ * scaling up)
+ *
+ * @param src The first source pixel
+ * @param width The source width
+ * @param height The source height
+ * @param stride The distance between the starts of two source rows in bytes
+ * @param channels The number of bytes per pixel, 1 or 3
+ * @param dst_width The target width
+ * @param dst_height The target height
+ * @param dst Receives the scaled pixels, packed without padding
+ */
+template <int Channels>
+void resample(const unsigned char *src, int width, int height, int stride,
+              int dst_width, int dst_height, unsigned char *dst) {
+    // Maps source columns (repeated when scaling up) to target columns,
+    // counting the number of source columns averaged into each target column.
+    int steps = std::max(width, dst_width);
+    std::vector<int> source(steps), target(steps), weight(dst_width, 0);
+    for (int x = 0; x < steps; x++) {
+        source[x] = Channels * (x * width / steps);
+        target[x] = Channels * (x * dst_width / steps);
+        weight[target[x] / Channels]++;
+    }
+    std::vector<unsigned int> sums(Channels * dst_width);
+    for (int y = 0; y < dst_height; y++) {
+        int y0 = y * height / dst_height;
+        int y1 = std::max((y + 1) * height / dst_height, y0 + 1);
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int sy = y0; sy < y1; sy++) {
+            const unsigned char *row = src + sy * stride;
+            for (int x = 0; x < steps; x++) {
+                for (int i = 0; i < Channels; i++)
+                    sums[target[x] + i] += row[source[x] + i];
+            }
+        }
+        for (int x = 0; x < dst_width; x++) {
+            unsigned int n = (y1 - y0) * weight[x];
+            for (int i = 0; i < Channels; i++)
+                *dst++ = (sums[Channels * x + i] + n / 2) / n;
+        }
+    }
+}
+
+void resample(const unsigned char *src, int width, int height, int stride,
+              int channels, int dst_width, int dst_height,
+              unsigned char *dst) {
+    if (channels == 1) {
+        resample<1>(src, width, height, stride, dst_width, dst_height, dst);
+    } else {
+        resample<3>(src, width, height, stride, dst_width, dst_height, dst);
+    }
+}
+
+/**
+ * @brief Reads uncompressed video frames (raw rgb24 or YUV4MPEG2) from a
+ * stream into reused buffers
+ *
+ * YUV frames are kept as planes, which are scaled to the output size
+ * separately and converted to RGB only at that size.
+ */
+class FrameReader {
+ public:
+    // Raw rgb24 frames of the given size, as from ffmpeg -f rawvideo
+    FrameReader(std::FILE *in, int width, int height)
+        : in_(in), width_(width), height_(height), raw_(true) {}
+
+    // A YUV4MPEG2 stream; check valid() for the result of parsing its header
+    explicit FrameReader(std::FILE *in) : in_(in), raw_(false) {
+        std::string header;
+        if (!readLine(header) || header.rfind("YUV4MPEG2", 0) != 0) return;
+        std::string colorspace = "420";
+        std::istringstream params(header.substr(9));
+        std::string param;
+        while (params >> param) {
+            if (param[0] == 'W') width_ = std::atoi(param.c_str() + 1);
+            if (param[0] == 'H') height_ = std::atoi(param.c_str() + 1);
+            if (param[0] == 'C') colorspace = param.substr(1);
+            int num, den;
+            if (param[0] == 'F' &&
+                std::sscanf(param.c_str() + 1, "%d:%d", &num, &den) == 2 &&
+                num > 0 && den > 0)
+                fps_ = static_cast<double>(num) / den;
+        }
+        if (colorspace == "420" || colorspace == "420jpeg" ||
+            colorspace == "420paldv" || colorspace == "420mpeg2") {
+            chroma_shift_x_ = chroma_shift_y_ = 1;
+        } else if (colorspace == "422") {
+            chroma_shift_x_ = 1;
+        } else if (colorspace == "mono") {
+            chroma_shift_x_ = -1;
+        } else if (colorspace != "444") {
+            width_ = 0;  // 10 bit and alpha formats are not supported
+        }
+    }
+
+    bool valid() const { return width_ > 0 && height_ > 0; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    double fps() const { return fps_; }  // 0 if unknown, as for raw video
+
+    // Reads the next frame; false at the end of the stream.
+    bool next() {
+        if (raw_) {
+            rgb_.resize(3 * width_ * height_);
+            return readFully(rgb_.data(), rgb_.size());
+        }
+        std::string frame;
+        if (!readLine(frame) || frame.rfind("FRAME", 0) != 0) return false;
+        yuv_.resize(width_ * height_ + 2 * chromaWidth() * chromaHeight());
+        return readFully(yuv_.data(), yuv_.size());
+    }
+
+    // Returns the current frame as RGB, scaled to width x height pixels.
+    PixelView frame(int width, int height) {
+        if (raw_) {
+            if (width == width_ && height == height_)
+                return PixelView{rgb_.data(), width_, height_, 3 * width_};
+            scaled_.resize(3 * width * height);
+            resample(rgb_.data(), width_, height_, 3 * width_, 3, width,
+                     height, scaled_.data());
+            return PixelView{scaled_.data(), width, height, 3 * width};
+        }
+
+        // Scale each plane to the target size, then convert.
+        size_t count = width * height;
+        planes_.resize(3 * count);
+        unsigned char *y_plane = planes_.data();
+        unsigned char *u_plane = y_plane + count;
+        unsigned char *v_plane = u_plane + count;
+        resample(yuv_.data(), width_, height_, width_, 1, width, height,
+                 y_plane);
+        if (chroma_shift_x_ >= 0) {
+            size_t chroma = chromaWidth() * chromaHeight();
+            const unsigned char *u = yuv_.data() + width_ * height_;
+            resample(u, chromaWidth(), chromaHeight(), chromaWidth(), 1,
+                     width, height, u_plane);
+            resample(u + chroma, chromaWidth(), chromaHeight(),
+                     chromaWidth(), 1, width, height, v_plane);
+        } else {
+            std::fill(u_plane, u_plane + 2 * count, 128);
+        }
+        scaled_.resize(3 * count);
+        for (size_t i = 0; i < count; i++)
+            yuvToRgb(y_plane[i], u_plane[i], v_plane[i], &scaled_[3 * i]);
+        return PixelView{scaled_.data(), width, height, 3 * width};
+    }
+
+    // BT.601 limited range YUV to RGB conversion
+    static void yuvToRgb(int y, int u, int v, unsigned char *rgb) {
+        int c = 298 * (y - 16) + 128;
+        int d = u - 128;
+        int e = v - 128;
+        rgb[0] = clamp_byte((c + 409 * e) >> 8);
+        rgb[1] = clamp_byte((c - 100 * d - 208 * e) >> 8);
+        rgb[2] = clamp_byte((c + 516 * d) >> 8);
+    }
+
+ private:
+    // Size of the chroma planes, 0 for mono
+    size_t chromaWidth() const {
+        return chroma_shift_x_ < 0 ? 0 : ((width_ - 1) >> chroma_shift_x_) + 1;
+    }
+    size_t chromaHeight() const {
+        return chroma_shift_x_ < 0 ? 0
+                                   : ((height_ - 1) >> chroma_shift_y_) + 1;
+    }
+
+    bool readLine(std::string &line) {
+        line.clear();
+        for (int c; (c = std::getc(in_)) != EOF;) {
+            if (c == '\n') return true;
+            line += static_cast<char>(c);
+        }
+        return false;
+    }
+
+    bool readFully(unsigned char *data, size_t length) {
+        return std::fread(data, 1, length, in_) == length;
+    }
+
+    std::FILE *in_;
+    double fps_ = 0;
+    int width_ = 0;
+    int height_ = 0;
+    bool raw_;
+    // Chroma subsampling as a power of two, -1 for no chroma (mono)
+    int chroma_shift_x_ = 0;
+    int chroma_shift_y_ = 0;
+    std::vector<unsigned char> yuv_;     // Y4M frame as read
+    std::vector<unsigned char> rgb_;     // Raw frame as read
+    std::vector<unsigned char> planes_;  // Scaled Y, U and V planes
+    std::vector<unsigned char> scaled_;  // Scaled RGB frame
+};
+
+// Set by SIGINT in the modes that keep running until interrupted, so that
+// they can restore the terminal before exiting.
+volatile std::sig_atomic_t interrupted = 0;
+
+void catchInterrupts() {
+#ifdef _POSIX_VERSION
+    struct sigaction action = {};
+    action.sa_handler = [](int) { interrupted = 1; };
+    // No SA_RESTART: blocking reads return, so the loops notice the flag.
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+#endif
+}
+
+volatile std::sig_atomic_t resized = 0;
+
+#ifdef __linux__
+// The signal mask to wait with in waitForInput(), which lets SIGWINCH through
+sigset_t resize_mask;
+bool resize_blocked = false;
+#endif
+
+// Sets 'resized' when the terminal is resized. On Linux, SIGWINCH is blocked
+// except while waiting in waitForInput(), so a resize right before waiting
+// still ends the wait. Call this before starting any threads, which would
+// otherwise receive the signal.
+void catchResizes() {
+#ifdef _POSIX_VERSION
+    struct sigaction action = {};
+    action.sa_handler = [](int) { resized = 1; };
+    sigaction(SIGWINCH, &action, nullptr);
+#endif
+#ifdef __linux__
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGWINCH);
+    if (!resize_blocked &&
+        pthread_sigmask(SIG_BLOCK, &blocked, &resize_mask) == 0) {
+        sigdelset(&resize_mask, SIGWINCH);
+        resize_blocked = true;
+    }
+#endif
+}
+
+#ifdef _POSIX_VERSION
+// Like poll(), but also ends (with EINTR) for a resize caught with
+// catchResizes() since 'resized' was checked last.
+int waitForInput(struct pollfd *fds, nfds_t count, int timeout) {
+#ifdef __linux__
+    if (resize_blocked) {
+        struct timespec limit = {timeout / 1000, timeout % 1000 * 1000000L};
+        return ppoll(fds, count, timeout < 0 ? nullptr : &limit,
+                     &resize_mask);
+    }
+#endif
+    return poll(fds, count, timeout);
+}
+
+// Sets maxWidth and maxHeight to the size of the terminal in pixels; false
+// (leaving them alone) if stdout is not a terminal.
+bool terminalSize(int &maxWidth, int &maxHeight) {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0 || (w.ws_col | w.ws_row) == 0)
+        return false;
+    maxWidth = w.ws_col * 4;
+    maxHeight = w.ws_row * 8;
+    return true;
+}
+#endif
+
+// The number of columns and rows to show a frame of the given size in,
+// scaling it down (but never up) to fit maxWidth x maxHeight pixels.
+size cellGridSize(size frame, int maxWidth, int maxHeight) {
+    if (frame.width > static_cast<unsigned>(maxWidth) ||
+        frame.height > static_cast<unsigned>(maxHeight))
+        frame = frame.fitted_within(size(maxWidth, maxHeight));
+    return size(frame.width / 4, frame.height / 8);
+}
+
+/**
+ * @brief Asks the terminal whether it supports synchronized updates (DEC
+ * private mode 2026), which make it show a frame only once all of it has
+ * arrived. The answer is cached.
+ */
+bool synchronized_updates() {
+    static int supported = -1;
+    if (supported >= 0) return supported;
+    supported = 0;
+#ifdef _POSIX_VERSION
+    if (!isatty(STDOUT_FILENO)) return false;
+    int fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct termios saved;
+    if (tcgetattr(fd, &saved) == 0) {
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(fd, TCSANOW, &raw);
+        // Requests the state of mode 2026 (DECRQM), followed by the primary
+        // device attributes. All terminals answer the latter, so there is no
+        // need to wait for a timeout if the first request is ignored.
+        const char query[] = "\x1b[?2026$p\x1b[c";
+        std::string reply;
+        if (write(fd, query, sizeof(query) - 1) == sizeof(query) - 1) {
+            struct pollfd input = {fd, POLLIN, 0};
+            char buffer[64];
+            while (reply.find('c', reply.find("\x1b[?")) == std::string::npos &&
+                   poll(&input, 1, 500) > 0) {
+                ssize_t n = read(fd, buffer, sizeof(buffer));
+                if (n <= 0) break;
+                reply.append(buffer, n);
+            }
+        }
+        tcsetattr(fd, TCSANOW, &saved);
+        // 1: set, 2: reset (but supported)
+        supported = reply.find("\x1b[?2026;1$y") != std::string::npos ||
+                    reply.find("\x1b[?2026;2$y") != std::string::npos;
+    }
+    close(fd);
+#endif
+    return supported;
+}
+
+// Writes all of out to fd (stdout if negative) with as few writes as
+// possible, so that the terminal receives a frame in one piece. fd may be
+// non-blocking. The
+// rest of a frame is still written once interrupted, so that no escape
+// sequence or synchronized update is left open, unless the terminal takes
+// nothing more for a second (e.g. stopped with ^S).
+void write_output(const std::string &out, int fd = -1) {
+#ifdef _POSIX_VERSION
+    if (fd < 0) fd = STDOUT_FILENO;
+    std::cout.flush();
+    size_t done = 0;
+    int stalled = 0;  // Polls without progress since interrupted
+    while (done < out.size() && !output_closed) {
+        ssize_t n = write(fd, out.data() + done, out.size() - done);
+        if (n > 0) {
+            done += n;
+            stalled = 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (interrupted && ++stalled > 10) break;
+            struct pollfd output = {fd, POLLOUT, 0};
+            poll(&output, 1, 100);
+        } else if (errno != EINTR) {
+            output_closed = true;
+        }
+    }
+#else
+    std::cout << out << std::flush;
+#endif
+}
+
+// Waits until the terminal has read most of the output already sent to it,
+// so frames don't pile up in the tty's output queue while the terminal falls
+// behind. This lowers the frame rate to what the terminal can show.
+void wait_for_terminal(size_t max_queued) {
+#ifdef TIOCOUTQ
+    for (int i = 0; i < 100 && !interrupted; i++) {
+        int queued;
+        if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) != 0 ||
+            static_cast<size_t>(queued) <= max_queued)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+#endif
+}
+
+/**
+ * @brief Paces playback to the wall clock, telling which frames are too late
+ * to be shown
+ */
+class FrameClock {
+ public:
+    using duration = std::chrono::steady_clock::duration;
+
+    FrameClock() : due_(std::chrono::steady_clock::now()) {}
+
+    // Whether the current frame, which is to be shown for the given time, is
+    // late enough that the next one is due already. Frames without a
+    // duration are never late.
+    bool late(duration shown_for) const {
+        return shown_for.count() > 0 &&
+               std::chrono::steady_clock::now() > due_ + shown_for;
+    }
+
+    // Moves on to the next frame and waits until it is due or interrupted.
+    void advance(duration shown_for) {
+        due_ += shown_for;
+        auto now = std::chrono::steady_clock::now();
+        while (!interrupted && now < due_) {
+            std::this_thread::sleep_for(
+                std::min<duration>(due_ - now, std::chrono::milliseconds(50)));
+            now = std::chrono::steady_clock::now();
+        }
+    }
+
+ private:
+    std::chrono::steady_clock::time_point due_;
+};
+
+/**
+ * @brief Renders frames of a fixed size in place, starting at the top left
+ * corner of the screen
+ *
+ * Only the cells that differ from the frame printed before are sent, unless
+ * repainting the whole frame takes fewer bytes. Content that moved up or down
+ * is scrolled within the terminal if that saves bytes. Each frame is written at
+ * once, within a synchronized update if the terminal supports those.
+ */
+class FramePrinter {
+ public:
+    // See findCharData() for the hysteresis, which is 0 for still frames.
+    FramePrinter(int columns, int rows, const int &flags, int hysteresis = 0)
+        : columns_(columns), rows_(rows), flags_(flags),
+          hysteresis_(flags & FLAG_NOOPT ? 0 : hysteresis),
+          cells_(columns * rows), hashes_(columns * rows, 0),
+          sync_(synchronized_updates()),
+          start_(std::chrono::steady_clock::now()) {
+        out_ = "\x1b[2J\x1b[?25l";  // Clear screen, hide cursor
+#ifdef _POSIX_VERSION
+        // Writes to a terminal wait in poll(), where they can be interrupted
+        // and timed. The terminal is opened again for that, as O_NONBLOCK on
+        // stdout would be shared with the shell and anything else using it.
+        const char *tty =
+            isatty(STDOUT_FILENO) ? ttyname(STDOUT_FILENO) : nullptr;
+        if (tty) fd_ = open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+#endif
+    }
+
+    ~FramePrinter() {
+#ifdef _POSIX_VERSION
+        if (fd_ >= 0) close(fd_);
+#endif
+        // Leave the cursor on the line below the frame, and show it
+        std::cout << "\x1b[" << rows_ << ";1H\x1b[?25h" << std::endl;
+        if (flags_ & FLAG_STATS) {
+            std::chrono::duration<double> seconds =
+                std::chrono::steady_clock::now() - start_;
+            std::chrono::duration<double, std::milli> writing = write_time_;
+            std::cerr << frames_ << " frames in " << seconds.count()
+                      << " s, " << bytes_ << " bytes ("
+                      << (frames_ ? bytes_ / frames_ : 0)
+                      << " per frame), " << repaints_ << " full repaints, "
+                      << scrolls_ << " scrolls, "
+                      << dropped_ << " late frames dropped, " << reused_
+                      << " unchanged cells reused, "
+                      << (frames_ ? writing.count() / frames_ : 0)
+                      << " ms per write" << std::endl;
+        }
+    }
+
+    // Renders the cells of a frame of columns * 4 x rows * 8 pixels.
+    void render(const PixelView &view) { render(view, 0, 0, columns_, rows_); }
+
+    // Renders only the cells from x0, y0 up to (excluding) x1, y1, keeping
+    // the others from the previous frame. Cells whose pixels hash the same
+    // as in the previous frame are kept as well.
+    void render(const PixelView &view, int x0, int y0, int x1, int y1) {
+        reused_ += renderCells(view, x0, y0, x1, y1);
+    }
+
+    // Like render(view), but splits the rows between up to 'threads' threads,
+    // for when most cells are expected to change.
+    void render(const PixelView &view, unsigned int threads) {
+        int bands = std::max(std::min<int>(threads, rows_), 1);
+        std::vector<std::future<unsigned long>> rendered;
+        for (int i = 1; i < bands; i++) {
+            rendered.push_back(std::async(
+                std::launch::async, &FramePrinter::renderCells, this,
+                std::cref(view), 0, i * rows_ / bands, columns_,
+                (i + 1) * rows_ / bands));
+        }
+        reused_ += renderCells(view, 0, 0, columns_, rows_ / bands);
+        for (auto &band : rendered) reused_ += band.get();
+    }
+
+    // Moves the rendered cells by dx columns and dy rows, as when the frame
+    // has been panned by whole cells, so that render() finds them unchanged.
+    // Only the cells moved in from outside have to be rendered again.
+    void shift(int dx, int dy) {
+        std::vector<CharData> cells(cells_.size());
+        std::vector<uint64_t> hashes(hashes_.size(), 0);
+        for (int y = std::max(dy, 0); y < std::min(rows_ + dy, rows_); y++) {
+            for (int x = std::max(dx, 0); x < std::min(columns_ + dx, columns_);
+                 x++) {
+                cells[y * columns_ + x] = cells_[(y - dy) * columns_ + x - dx];
+                hashes[y * columns_ + x] =
+                    hashes_[(y - dy) * columns_ + x - dx];
+            }
+        }
+        cells_.swap(cells);
+        hashes_.swap(hashes);
+    }
+
+    // Sets the cells from x0, y0 on to those of a grid of width x height
+    // cells made elsewhere, such as text.
+    void place(const CharData *cells, int width, int height, int x0, int y0) {
+        for (int y = std::max(y0, 0); y < std::min(y0 + height, rows_); y++) {
+            for (int x = std::max(x0, 0); x < std::min(x0 + width, columns_);
+                 x++) {
+                cells_[y * columns_ + x] = cells[(y - y0) * width + x - x0];
+                hashes_[y * columns_ + x] = 0;
+            }
+        }
+    }
+
+    int columns() const { return columns_; }
+    int rows() const { return rows_; }
+
+    // Forgets what is on the screen, so the next frame is printed in full on
+    // a cleared screen, as after the terminal has been resized.
+    void clear() {
+        printed_.clear();
+        out_ += "\x1b[2J";
+    }
+
+    // Prints the last rendered frame; false if stdout has been closed.
+    bool print() {
+        size_t prefix = out_.size();
+        if (!printed_.empty()) {
+            printChanges(printed_);
+            int shift = findScroll();
+            if (shift != 0) {
+                std::string changes = out_.substr(prefix);
+                out_.resize(prefix);
+                printScrolled(shift);
+                if (out_.size() - prefix < changes.size()) {
+                    scrolls_++;
+                } else {
+                    out_.resize(prefix);
+                    out_ += changes;
+                }
+            }
+        }
+        if (printed_.empty() || out_.size() - prefix >= repaint_bytes_) {
+            std::string changes = out_.substr(prefix);
+            out_.resize(prefix);
+            printAll();
+            repaint_bytes_ = out_.size() - prefix;
+            if (!changes.empty() && changes.size() < out_.size() - prefix) {
+                out_.resize(prefix);
+                out_ += changes;
+            } else {
+                repaints_++;
+            }
+        }
+        printed_ = cells_;
+        frames_++;
+        if (out_.empty()) return output_ok();  // Nothing changed
+        if (sync_) {
+            out_.insert(0, "\x1b[?2026h");  // Begin synchronized update
+            out_ += "\x1b[?2026l";          // End synchronized update
+        }
+        bytes_ += out_.size();
+        wait_for_terminal(out_.size() / 4);
+        auto started = std::chrono::steady_clock::now();
+        write_output(out_, fd_);
+        write_time_ += std::chrono::steady_clock::now() - started;
+        out_.clear();
+        return output_ok();
+    }
+
+    // Counts a frame that was skipped for being late.
+    void drop() { dropped_++; }
+
+ private:
+    // Renders the cells from x0, y0 up to (excluding) x1, y1, returning the
+    // number of those that were kept as their pixels hash the same.
+    unsigned long renderCells(const PixelView &view, int x0, int y0, int x1,
+                              int y1) {
+        unsigned long reused = 0;
+        for (int y = std::max(y0, 0); y < std::min(y1, rows_); y++) {
+            for (int x = std::max(x0, 0); x < std::min(x1, columns_); x++) {
+                CharData &cell = cells_[y * columns_ + x];
+                uint64_t hash = hashCell(view, x * 4, y * 8);
+                if (hashes_[y * columns_ + x] == hash) {
+                    reused++;
+                    continue;
+                }
+                hashes_[y * columns_ + x] = hash;
+                cell = hysteresis_ ? findCharData(view, x * 4, y * 8, flags_,
+                                                  cell, hysteresis_)
+                                   : renderCell(view, x * 4, y * 8, flags_);
+            }
+        }
+        return reused;
+    }
+
+    void printAll() {
+        out_ += "\x1b[H";
+        for (int y = 0; y < rows_; y++) {
+            printCells(out_, &cells_[y * columns_], columns_, flags_);
+            if (y < rows_ - 1) out_ += '\n';
+        }
+    }
+
+    // Prints runs of cells that differ from the given screen contents,
+    // moving the cursor to the start of each.
+    void printChanges(const std::vector<CharData> &screen) {
+        for (int y = 0; y < rows_; y++) {
+            const CharData *row = &cells_[y * columns_];
+            const CharData *printed = &screen[y * columns_];
+            int cursor = -1;  // Column after the last run in this row
+            forEachChangedRun(row, printed, columns_, flags_,
+                              [&](int x, int end) {
+                if (cursor < 0) {
+                    out_ += "\x1b[" + std::to_string(y + 1) + ';' +
+                            std::to_string(x + 1) + 'H';
+                } else {
+                    out_ += "\x1b[" + std::to_string(x - cursor) + 'C';
+                }
+                printCells(out_, row + x, end - x, flags_);
+                cursor = end;
+            });
+        }
+    }
+
+    uint64_t hashRow(const CharData *row) const {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (int x = 0; x < columns_; x++) {
+            const CharData &cell = row[x];
+            for (int value : {cell.codePoint, cell.fgColor[0], cell.fgColor[1],
+                              cell.fgColor[2], cell.bgColor[0],
+                              cell.bgColor[1], cell.bgColor[2]})
+                hash = (hash ^ value) * 0x100000001b3;
+        }
+        return hash;
+    }
+
+    // Returns by how many rows most of the content moved up (positive) or
+    // down since the last frame was printed, or 0, by matching row hashes.
+    int findScroll() {
+        row_hashes_.resize(2 * rows_);
+        uint64_t *now = row_hashes_.data();
+        uint64_t *before = now + rows_;
+        int matches = 0;  // Without scrolling
+        for (int y = 0; y < rows_; y++) {
+            now[y] = hashRow(&cells_[y * columns_]);
+            before[y] = hashRow(&printed_[y * columns_]);
+            if (now[y] == before[y]) matches++;
+        }
+        int best = 0;
+        for (int shift = 1 - rows_; shift < rows_; shift++) {
+            int shifted = 0;
+            int end = std::min(rows_, rows_ - shift);
+            for (int y = std::max(0, -shift); y < end; y++) {
+                if (now[y] == before[y + shift]) shifted++;
+            }
+            if (shifted > matches) {
+                matches = shifted;
+                best = shift;
+            }
+        }
+        return best;
+    }
+
+    // Scrolls the rows of the frame by 'shift' (see findScroll()) with a
+    // scroll region (DECSTBM) and SU or SD, then prints the cells that still
+    // differ, including the rows scrolled in.
+    void printScrolled(int shift) {
+        CharData blank;
+        blank.codePoint = -1;  // Never matches a cell
+        scrolled_.assign(printed_.size(), blank);
+        for (int y = std::max(0, -shift); y < std::min(rows_, rows_ - shift);
+             y++) {
+            std::copy_n(&printed_[(y + shift) * columns_], columns_,
+                        &scrolled_[y * columns_]);
+        }
+        out_ += "\x1b[1;" + std::to_string(rows_) + 'r';
+        out_ += "\x1b[" + std::to_string(std::abs(shift)) +
+                (shift > 0 ? 'S' : 'T');
+        out_ += "\x1b[r";  // Reset the scroll region
+        printChanges(scrolled_);
+    }
+
+    int columns_;
+    int rows_;
+    int flags_;
+    int hysteresis_;
+    std::vector<CharData> cells_;
+    std::vector<uint64_t> hashes_;  // Of the pixels of cells_, 0 if unknown
+    std::vector<CharData> printed_;  // The cells currently on the screen
+    std::vector<CharData> scrolled_;  // printed_ after scrolling
+    std::vector<uint64_t> row_hashes_;
+    std::string out_;
+    bool sync_;  // Wrap frames in synchronized updates
+    int fd_ = -1;  // Non-blocking descriptor of the terminal, if stdout is one
+    size_t repaint_bytes_ = 0;  // Size of the last full repaint
+
+    // For FLAG_STATS
+    std::chrono::steady_clock::time_point start_;
+    unsigned long frames_ = 0;
+    unsigned long bytes_ = 0;
+    unsigned long repaints_ = 0;
+    unsigned long dropped_ = 0;
+    unsigned long reused_ = 0;  // Cells not rendered again
+    unsigned long scrolls_ = 0;
+    std::chrono::steady_clock::duration write_time_{0};
+};
+
+/**
+ * @brief Print an image in two passes, scaled down to fit maxWidth x
+ * maxHeight pixels like in 'full' mode: first a preview of half blocks made
+ * from a box filtered copy, then the cells the full kernel finds for the
+ * image scaled as usual, printed in place of those that look different
+ *
+ * The second pass moves the cursor back up over the preview, so it is only
+ * taken if all of the image fits on the terminal. Otherwise, as when stdout
+ * is not a terminal, the image is printed once as usual.
+ *
+ * @param image The image, which is scaled down in place
+ * @param maxWidth The maximum width of the output in pixels
+ * @param maxHeight The maximum height of the output in pixels
+ * @param flags The rendering flags
+ */
+void printProgressively(cimg_library::CImg<unsigned char> &image,
+                        int maxWidth, int maxHeight, const int &flags) {
+    size fitted(image.width(), image.height());
+    if (image.width() > maxWidth || image.height() > maxHeight)
+        fitted = fitted.fitted_within(size(maxWidth, maxHeight));
+    int columns = fitted.width / 4, rows = fitted.height / 8;
+    int screen_width = 0, screen_height = 0;
+#ifdef _POSIX_VERSION
+    terminalSize(screen_width, screen_height);
+#endif
+    if (columns == 0 || rows == 0 || columns > screen_width / 4 ||
+        rows > screen_height / 8) {
+        image.resize(fitted.width, fitted.height, -100, -100, 5);
+        printImage(image, flags);
+        return;
+    }
+
+    // The box filter takes one pass over the planes of the image, and half
+    // blocks take no search.
+    std::vector<unsigned char> plane(fitted.width * fitted.height);
+    std::vector<unsigned char> pixels(3 * plane.size());
+    for (int c = 0; c < 3; c++) {
+        resample(image.data(0, 0, 0, c), image.width(), image.height(),
+                 image.width(), 1, fitted.width, fitted.height, plane.data());
+        for (size_t i = 0; i < plane.size(); i++) pixels[3 * i + c] = plane[i];
+    }
+    PixelView preview_view{pixels.data(), static_cast<int>(fitted.width),
+                           static_cast<int>(fitted.height),
+                           static_cast<int>(3 * fitted.width)};
+    std::vector<CharData> preview(columns * rows);
+    std::string out;
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++)
+            preview[y * columns + x] = renderCell(preview_view, x * 4, y * 8,
+                                                  flags | FLAG_NOOPT);
+        if (y > 0) out += '\n';
+        printCells(out, &preview[y * columns], columns, flags);
+    }
+    std::cout << out << std::flush;
+
+    image.resize(fitted.width, fitted.height, -100, -100, 5);
+    // Back to the first row, then along the runs of changed cells
+    out = rows > 1 ? "\x1b[" + std::to_string(rows - 1) + "A" : "";
+    std::vector<CharData> row;
+    for (int y = 0; y < rows; y++) {
+        if (y > 0) out += '\n';
+        renderRow(image, y * 8, flags, row);
+        forEachChangedRun(row.data(), &preview[y * columns], columns, flags,
+                          [&](int x, int end) {
+            out += '\r';
+            if (x > 0) out += "\x1b[" + std::to_string(x) + "C";
+            printCells(out, &row[x], end - x, flags);
+        });
+    }
+    std::cout << out << std::endl;
+}
+
+/**
+ * @brief Play uncompressed video from stdin, rendering each frame in place
+ *
+ * Frames are shown at the given rate, skipping those that are late.
+ *
+ * @param reader The source of the frames
+ * @param fps The frame rate, or 0 to show frames as fast as they arrive
+ * @param maxWidth The maximum width of the output in pixels
+ * @param maxHeight The maximum height of the output in pixels
+ * @param flags The rendering flags
+ * @param hysteresis See findCharData()
+ * @return int The program exit code
+ */
+int playVideo(FrameReader &reader, double fps, int maxWidth, int maxHeight,
+              const int &flags, int hysteresis) {
+    if (!reader.valid()) {
+        std::cerr << "Error: Unsupported video stream" << std::endl;
+        return EXITCODE_DATA_FORMAT_ERROR;
+    }
+    size grid = cellGridSize(size(reader.width(), reader.height()), maxWidth,
+                             maxHeight);
+
+    FrameClock::duration interval(0);
+    if (fps > 0) {
+        interval = std::chrono::duration_cast<FrameClock::duration>(
+            std::chrono::duration<double>(1 / fps));
+    }
+
+    catchInterrupts();
+    FramePrinter printer(grid.width, grid.height, flags, hysteresis);
+    FrameClock clock;
+    while (!interrupted && reader.next()) {
+        if (clock.late(interval)) {
+            printer.drop();
+        } else {
+            printer.render(reader.frame(grid.width * 4, grid.height * 8));
+            if (!printer.print()) break;
+        }
+        clock.advance(interval);
+    }
+    return EXITCODE_OK;
+}
+
+/**
+ * @brief Play an animated GIF in place, rendering only the cells covering the
+ * part of the canvas that changed with each frame
+ *
+ * @param gif The decoded GIF
+ * @param maxWidth The maximum width of the output in pixels
+ * @param maxHeight The maximum height of the output in pixels
+ * @param flags The rendering flags
+ * @return int The program exit code
+ */
+int playAnimation(GifDecoder &gif, int maxWidth, int maxHeight,
+                  const int &flags) {
+    int width = gif.width();
+    int height = gif.height();
+    size grid = cellGridSize(size(width, height), maxWidth, maxHeight);
+    int grid_width = grid.width * 4;
+    int grid_height = grid.height * 8;
+    std::vector<unsigned char> scaled;
+    if (grid_width != width || grid_height != height)
+        scaled.resize(3 * grid_width * grid_height);
+
+    // The cells changed by frames not rendered yet
+    int dirty_x0 = grid.width, dirty_y0 = grid.height;
+    int dirty_x1 = 0, dirty_y1 = 0;
+
+    catchInterrupts();
+    FramePrinter printer(grid.width, grid.height, flags);
+    FrameClock clock;
+    for (int played = 0; gif.plays() == 0 || played < gif.plays(); played++) {
+        if (played > 0) gif.rewind();
+        int frames = 0;
+        while (!interrupted && gif.next()) {
+            frames++;
+            GifRect changed = gif.changed();
+            int x0 = changed.x;
+            int y0 = changed.y;
+            int x1 = changed.x + changed.width;
+            int y1 = changed.y + changed.height;
+            if (!scaled.empty()) {
+                // Target pixels averaging any of the changed ones
+                x0 = x0 * grid_width / width;
+                y0 = y0 * grid_height / height;
+                x1 = (x1 * grid_width + width - 1) / width + 1;
+                y1 = (y1 * grid_height + height - 1) / height + 1;
+            }
+            dirty_x0 = std::min(dirty_x0, x0 / 4);
+            dirty_y0 = std::min(dirty_y0, y0 / 8);
+            dirty_x1 = std::max(dirty_x1, (x1 + 3) / 4);
+            dirty_y1 = std::max(dirty_y1, (y1 + 7) / 8);
+
+            // Like browsers, show frames without a delay for 100 ms.
+            auto delay = std::chrono::milliseconds(
+                gif.delay() > 10 ? gif.delay() : 100);
+            if (clock.late(delay)) {
+                printer.drop();
+                clock.advance(delay);
+                continue;
+            }
+            PixelView view = gif.canvas();
+            if (!scaled.empty()) {
+                resample(view.data, width, height, view.stride, 3, grid_width,
+                         grid_height, scaled.data());
+                view = PixelView{scaled.data(), grid_width, grid_height,
+                                 3 * grid_width};
+            }
+            printer.render(view, dirty_x0, dirty_y0, dirty_x1, dirty_y1);
+            dirty_x0 = grid.width;
+            dirty_y0 = grid.height;
+            dirty_x1 = dirty_y1 = 0;
+            if (!printer.print()) return EXITCODE_OK;
+            clock.advance(delay);
+        }
+        if (interrupted) break;
+        if (frames == 0) {
+            std::cerr << "Error: GIF without frames" << std::endl;
+            return EXITCODE_DATA_FORMAT_ERROR;
+        }
+    }
+    return EXITCODE_OK;
+}
+
+#ifdef _POSIX_VERSION
+/**
+ * @brief Maps a POSIX shared memory ring buffer of frames (see tiv_shm.h)
+ * for reading
+ */
+class SharedFrames {
+ public:
+    // Maps the frames of the given size published under the name; see
+    // error() for whether that worked.
+    SharedFrames(const std::string &name, int width, int height)
+        : width_(width), height_(height) {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "Error: Cannot open shared memory '" << name
+                      << "': " << strerror(errno) << std::endl;
+            if (fd >= 0) close(fd);
+            return;
+        }
+        length_ = st.st_size;
+        void *mapping = length_ < TIV_SHM_DATA_OFFSET
+                            ? MAP_FAILED
+                            : mmap(nullptr, length_, PROT_READ, MAP_SHARED,
+                                   fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Error: Cannot map shared memory '" << name << "'"
+                      << std::endl;
+            return;
+        }
+        // The mapping is read-only; the atomic is only ever loaded.
+        mapping_ = mapping;
+        header_ = static_cast<const TivShmHeader *>(mapping);
+        frame_size_ = static_cast<size_t>(header_->stride) * height;
+        if (header_->magic != TIV_SHM_MAGIC ||
+            header_->format != TIV_SHM_FORMAT_RGB24 || header_->slots == 0 ||
+            header_->stride < 3u * width ||
+            length_ < TIV_SHM_DATA_OFFSET + header_->slots * frame_size_) {
+            std::cerr << "Error: '" << name << "' does not contain " << width
+                      << "x" << height << " RGB frames" << std::endl;
+            error_ = EXITCODE_DATA_FORMAT_ERROR;
+            return;
+        }
+        if (header_->slots < 2) {
+            // The producer would overwrite every frame while it is read.
+            std::cerr << "Error: '" << name << "' has only one frame slot, "
+                      << "at least two are needed" << std::endl;
+            error_ = EXITCODE_DATA_FORMAT_ERROR;
+            return;
+        }
+        error_ = EXITCODE_OK;
+    }
+
+    ~SharedFrames() {
+        if (mapping_) munmap(mapping_, length_);
+    }
+
+    // The exit code for failing to map the frames, or EXITCODE_OK.
+    int error() const { return error_; }
+
+    // The number of frames published so far.
+    uint64_t sequence() const {
+        return header_->sequence.load(std::memory_order_acquire);
+    }
+
+    // The frame with the given (nonzero) sequence number, which stays valid
+    // until the producer gets around to overwriting its slot.
+    PixelView frame(uint64_t sequence) const {
+        const unsigned char *data =
+            static_cast<const unsigned char *>(mapping_) + TIV_SHM_DATA_OFFSET;
+        return PixelView{data + (sequence - 1) % header_->slots * frame_size_,
+                         width_, height_, static_cast<int>(header_->stride)};
+    }
+
+    // Whether the frame may have been overwritten while it was read. The
+    // producer starts overwriting its slot once it has published slots - 1
+    // more frames.
+    bool torn(uint64_t sequence) const {
+        // Keeps the reads of the frame from moving past the check.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header_->sequence.load(std::memory_order_relaxed) >=
+               sequence - 1 + header_->slots;
+    }
+
+ private:
+    int width_, height_;
+    void *mapping_ = nullptr;
+    size_t length_ = 0;
+    const TivShmHeader *header_ = nullptr;
+    size_t frame_size_ = 0;
+    int error_ = EXITCODE_NO_INPUT_ERROR;
+};
+
+/**
+ * @brief Show the frames another process publishes to a POSIX shared memory
+ * ring buffer (see tiv_shm.h), rendering the latest one whenever it changes
+ *
+ * Each frame is copied (or scaled) out of the mapping and checked for having
+ * been overwritten meanwhile before it is rendered, so the hashes of the cells
+ * always match the pixels they were rendered from.
+ *
+ * @param name The name of the shared memory object
+ * @param width The width of the frames
+ * @param height The height of the frames
+ * @param maxWidth The maximum width of the output in pixels
+ * @param maxHeight The maximum height of the output in pixels
+ * @param flags The rendering flags
+ * @param hysteresis See findCharData()
+ * @return int The program exit code
+ */
+int playSharedMemory(const std::string &name, int width, int height,
+                     int maxWidth, int maxHeight, const int &flags,
+                     int hysteresis) {
+    SharedFrames frames(name, width, height);
+    if (frames.error() != EXITCODE_OK) return frames.error();
+
+    size grid = cellGridSize(size(width, height), maxWidth, maxHeight);
+    int grid_width = grid.width * 4;
+    int grid_height = grid.height * 8;
+    std::vector<unsigned char> pixels(3 * grid_width * grid_height);
+    uint64_t shown = 0;
+
+    catchInterrupts();
+    FramePrinter printer(grid.width, grid.height, flags, hysteresis);
+    while (!interrupted) {
+        uint64_t sequence = frames.sequence();
+        if (sequence == shown) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+        PixelView frame = frames.frame(sequence);
+        if (width != grid_width || height != grid_height) {
+            resample(frame.data, width, height, frame.stride, 3, grid_width,
+                     grid_height, pixels.data());
+        } else {
+            for (int y = 0; y < height; y++) {
+                std::copy_n(frame.data + y * frame.stride, 3 * width,
+                            &pixels[3 * y * width]);
+            }
+        }
+        // Discard the frame if it may be torn.
+        if (frames.torn(sequence)) continue;
+        shown = sequence;
+        printer.render(
+            PixelView{pixels.data(), grid_width, grid_height, 3 * grid_width});
+        if (!printer.print()) break;
+    }
+    return EXITCODE_OK;
+}
+#endif
+
+#ifdef __linux__
+/**
+ * @brief Read a whole file into a buffer that is reused between calls
+ *
+ * Files that are watched or followed are read rather than mapped, as they may
+ * be truncated while being decoded, which would fault on a mapping.
+ *
+ * @param filename The file
+ * @param data Receives the contents of the file
+ * @return bool Whether anything was read
+ */
+bool readFile(const std::string &filename, std::vector<unsigned char> &data) {
+    data.clear();
+    int file = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    while (file >= 0) {
+        size_t done = data.size();
+        data.resize(std::max<size_t>(2 * done, 65536));
+        ssize_t n = read(file, data.data() + done, data.size() - done);
+        data.resize(done + std::max<ssize_t>(n, 0));
+        if (n == 0 || (n < 0 && errno != EINTR)) break;
+    }
+    if (file >= 0) close(file);
+    return !data.empty();
+}
+
+/**
+ * @brief Read the events waiting on an inotify file descriptor, with a single
+ * read that blocks unless the descriptor is non-blocking
+ *
+ * @param fd The inotify file descriptor
+ * @param handle Called with the watch descriptor and the file name of each
+ * event about a file in a watched directory
+ * @return bool Whether any events were read
+ */
+template <typename Handle>
+bool readInotifyEvents(int fd, Handle handle) {
+    alignas(struct inotify_event) char events[4096];
+    ssize_t n = read(fd, events, sizeof(events));
+    for (ssize_t i = 0; i < n;) {
+        auto *event = reinterpret_cast<struct inotify_event *>(events + i);
+        if (event->len > 0) handle(event->wd, event->name);
+        i += sizeof(struct inotify_event) + event->len;
+    }
+    return n > 0;
+}
+
+/**
+ * @brief Watch a file for being rewritten, through its directory
+ *
+ * Watching the directory also catches the file being replaced by renaming
+ * another one over it, as editors and many programs do.
+ *
+ * @param fd The inotify file descriptor
+ * @param filename The file
+ * @param name Receives the name of the file within its directory, as
+ * reported by readInotifyEvents()
+ * @return int The watch descriptor, or -1 with errno set
+ */
+int watchFile(int fd, const std::string &filename, std::string &name) {
+    std::filesystem::path path(filename);
+    std::string directory = path.has_parent_path()
+                                ? path.parent_path().string()
+                                : std::string(".");
+    name = path.filename().string();
+    return inotify_add_watch(fd, directory.c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
+/**
+ * @brief Hands out the image files in a directory, then those that appear in
+ * it later, as they are closed after writing or moved in
+ *
+ * Every file is handed out once. A file rewritten later is not shown again,
+ * and neither are names starting with a dot, which are commonly used for
+ * files still being written.
+ */
+class DirectoryFollower {
+ public:
+    explicit DirectoryFollower(const std::string &directory)
+        : directory_(directory) {
+        // Watching before listing the directory means no file is missed;
+        // one arriving in between is seen twice, but only handed out once.
+        fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd_ < 0 || inotify_add_watch(fd_, directory.c_str(),
+                                         IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            error_ = strerror(errno);
+            return;
+        }
+        std::vector<std::string> names;
+        std::error_code error;
+        for (std::filesystem::directory_iterator it(directory, error), end;
+             !error && it != end; it.increment(error)) {
+            if (std::filesystem::is_regular_file(it->status(error)))
+                names.push_back(it->path().filename().string());
+        }
+        if (error) {
+            error_ = error.message();
+            return;
+        }
+        std::sort(names.begin(), names.end());
+        for (auto &name : names) add(name);
+    }
+
+    ~DirectoryFollower() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Empty unless the directory cannot be followed
+    const std::string &error() const { return error_; }
+
+    // Hands out the next image file that arrived, without waiting; false if
+    // there is none yet. Like DirectoryWalker::next(), the file comes along
+    // with the contents used to identify it, read rather than mapped.
+    bool next(std::string &name, std::unique_ptr<FileData> &file) {
+        read_events();
+        while (!arrived_.empty()) {
+            name = directory_ + "/" + arrived_.front();
+            arrived_.pop_front();
+            std::error_code error;
+            std::vector<unsigned char> data;
+            if (!std::filesystem::is_regular_file(name, error) ||
+                !readFile(name, data))
+                continue;
+            file = std::make_unique<FileData>(std::move(data));
+            if (sniff_format(file->data(),
+                             std::min(file->size(), SNIFF_SIZE)) !=
+                FORMAT_UNKNOWN)
+                return true;
+        }
+        file.reset();
+        return false;
+    }
+
+    // Blocks until more files may have arrived; false if interrupted.
+    bool wait() {
+        struct pollfd watch = {fd_, POLLIN, 0};
+        while (!interrupted) {
+            if (poll(&watch, 1, -1) > 0) return true;
+            if (errno != EINTR) break;
+        }
+        return false;
+    }
+
+ private:
+    void add(const std::string &name) {
+        if (name.empty() || name[0] == '.') return;
+        if (seen_.insert(name).second) arrived_.push_back(name);
+    }
+
+    void read_events() {
+        while (readInotifyEvents(fd_, [&](int, const char *name) {
+            add(name);
+        })) {
+        }
+    }
+
+    std::string directory_;
+    int fd_ = -1;
+    std::string error_;
+    std::deque<std::string> arrived_;
+    std::set<std::string> seen_;
+};
+#endif
+
+#ifdef __linux__
+/**
+ * @brief A decoded image along with copies of it halved in size over and over,
+ * so that it can be shown at any smaller size by scaling down a copy at most
+ * twice as large
+ */
+class ImagePyramid {
+ public:
+    explicit ImagePyramid(cimg_library::CImg<unsigned char> image) {
+        levels_.push_back(std::move(image));
+        while (levels_.back().width() >= 8 && levels_.back().height() >= 16) {
+            const auto &level = levels_.back();
+            // Averages each 2x2 block
+            levels_.push_back(level.get_resize(level.width() / 2,
+                                               level.height() / 2, -100, -100,
+                                               2));
+        }
+    }
+
+    // The size of the original image
+    size dimensions() const { return size(levels_[0]); }
+
+    // The image scaled to the given size (which must not exceed that of the
+    // original), made from the smallest copy that is at least as large.
+    cimg_library::CImg<unsigned char> scaled(size target) const {
+        auto level = levels_.rbegin();
+        while (static_cast<unsigned>(level->width()) < target.width ||
+               static_cast<unsigned>(level->height()) < target.height)
+            ++level;
+        return level->get_resize(target.width, target.height, -100, -100, 5);
+    }
+
+ private:
+    std::vector<cimg_library::CImg<unsigned char>> levels_;
+};
+
+/**
+ * @brief Show an image in place and show it again whenever the file has been
+ * rewritten or replaced, until interrupted
+ *
+ * When the terminal is resized, the image is fitted to the new size from an
+ * ImagePyramid kept since decoding it, so that takes no more than scaling.
+ *
+ * @param filename The image file
+ * @param maxWidth The maximum width of the output in pixels
+ * @param maxHeight The maximum height of the output in pixels
+ * @param fitTerminal Whether the maximum size is that of the terminal, and
+ * changes with it
+ * @param flags The rendering flags
+ * @param bgColor The background color in case of a transparent image
+ * @return int The program exit code
+ */
+int watchImage(const std::string &filename, int maxWidth, int maxHeight,
+               bool fitTerminal, const int &flags, unsigned char *bgColor) {
+    std::string name;
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || watchFile(fd, filename, name) < 0) {
+        std::cerr << "Error: Cannot watch '" << filename
+                  << "': " << strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return EXITCODE_NO_INPUT_ERROR;
+    }
+
+    // Reused between reloads
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> pixels;
+    std::unique_ptr<ImagePyramid> pyramid;
+    std::unique_ptr<FramePrinter> printer;
+    int ret = EXITCODE_OK;
+
+    catchInterrupts();
+    if (fitTerminal) catchResizes();
+    bool changed = true;
+    while (!interrupted) {
+        if (changed && readFile(filename, data)) {
+            try {
+                pyramid = std::make_unique<ImagePyramid>(load_rgb_CImg(
+                    data.data(), data.size(), filename.c_str(), bgColor));
+            } catch (cimg_library::CImgIOException &e) {
+                // Keep showing the last image until the next change.
+                if (!pyramid) {
+                    std::cerr << "Error: '" << filename
+                              << "' has an unrecognized file format"
+                              << std::endl;
+                    ret = EXITCODE_DATA_FORMAT_ERROR;
+                    break;
+                }
+            }
+        }
+        if (pyramid) {
+            size fitted = pyramid->dimensions();
+            if (fitted.width > static_cast<unsigned>(maxWidth) ||
+                fitted.height > static_cast<unsigned>(maxHeight))
+                fitted = fitted.fitted_within(size(maxWidth, maxHeight));
+            cimg_library::CImg<unsigned char> image =
+                pyramid->scaled(fitted);
+            int columns = image.width() / 4;
+            int rows = image.height() / 8;
+            pixels.resize(3 * image.width() * image.height());
+            packPixels(image, 0, 0, image.width(), image.height(),
+                       pixels.data(), 3 * image.width());
+            // A new size needs a new screen
+            if (!printer || printer->columns() != columns ||
+                printer->rows() != rows) {
+                printer.reset();
+                printer = std::make_unique<FramePrinter>(columns, rows, flags);
+            }
+            printer->render(PixelView{pixels.data(), image.width(),
+                                      image.height(), 3 * image.width()});
+            if (!printer->print()) break;
+        }
+
+        // Wait for the file to change, then for the writes to stop for
+        // 100 ms, so a burst of writes leads to one reload. Resizing the
+        // terminal ends the wait right away.
+        changed = false;
+        struct pollfd watch = {fd, POLLIN, 0};
+        int ready;
+        while (!interrupted && !resized &&
+               (ready = waitForInput(&watch, 1, changed ? 100 : -1)) != 0) {
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            readInotifyEvents(fd, [&](int, const char *event_name) {
+                if (name == event_name) changed = true;
+            });
+        }
+        if (resized) {
+            resized = 0;
+            terminalSize(maxWidth, maxHeight);
+            // Terminals may reflow or clear the screen when resized, even if
+            // the image keeps its size, so it is painted again in full.
+            if (printer) printer->clear();
+        } else if (!changed) {
+            break;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Show a grid of live sources, images files and shared memory frames,
+ * rendering each tile again only when its source changes, until interrupted
+ *
+ * The tiles are laid out like the thumbnails in 'dir' mode. All of them are
+ * composed into one frame, of which only the cells of changed tiles are
+ * rendered again, and only the cells that changed are printed.
+ *
+ * @param files The image files, shown again when they are rewritten
+ * @param frames The shared memory objects with their frame sizes
+ * @param columns The number of tiles per row
+ * @param maxWidth The maximum width of the output in pixels
+ * @param maxHeight The maximum height of the output in pixels
+ * @param flags The rendering flags
+ * @param bgColor The background color in case of a transparent image
+ * @return int The program exit code
+ */
+int playWall(const std::vector<std::string> &files,
+             const std::vector<std::pair<std::string, size>> &frames,
+             int columns, int maxWidth, int maxHeight, const int &flags,
+             unsigned char *bgColor) {
+    struct Tile {
+        int x, y;  // The top left pixel
+        std::string filename;
+        int watch = -1;  // The inotify watch of the file's directory
+        std::string name;  // The file's name within that directory
+        bool changed = true;
+        std::unique_ptr<SharedFrames> frames;
+        uint64_t shown = 0;  // The sequence number of the frame shown
+    };
+    int count = files.size() + frames.size();
+    columns = std::min(columns, count);
+    int rows = (count + columns - 1) / columns;
+    // Tiles are square, unless that doesn't fit, and one cell apart.
+    int cw = ((maxWidth / 4) - 2 * (columns - 1)) / columns;
+    int ch = std::min(cw / 2, ((maxHeight / 8) - (rows - 1)) / rows);
+    if (cw <= 0 || ch <= 0) {
+        std::cerr << "Error: The terminal is too small for " << count
+                  << " tiles" << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+    }
+    int tw = cw * 4, th = ch * 8;
+    int width = columns * (tw + 8) - 8;
+    int height = rows * (th + 8) - 8;
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot watch files: " << strerror(errno)
+                  << std::endl;
+        return EXITCODE_NO_INPUT_ERROR;
+    }
+    std::vector<Tile> tiles(count);
+    int ret = EXITCODE_OK;
+    for (int i = 0; i < count && ret == EXITCODE_OK; i++) {
+        Tile &tile = tiles[i];
+        tile.x = i % columns * (tw + 8);
+        tile.y = i / columns * (th + 8);
+        if (i < static_cast<int>(files.size())) {
+            tile.filename = files[i];
+            tile.watch = watchFile(fd, files[i], tile.name);
+            if (tile.watch < 0) {
+                std::cerr << "Error: Cannot watch '" << files[i]
+                          << "': " << strerror(errno) << std::endl;
+                ret = EXITCODE_NO_INPUT_ERROR;
+            }
+        } else {
+            auto &source = frames[i - files.size()];
+            tile.frames = std::make_unique<SharedFrames>(
+                source.first, source.second.width, source.second.height);
+            ret = tile.frames->error();
+        }
+    }
+    if (ret != EXITCODE_OK) {
+        close(fd);
+        return ret;
+    }
+
+    // The whole wall, of which each tile's source only ever writes its own
+    // rectangle.
+    std::vector<unsigned char> pixels(3 * width * height, 0);
+    PixelView wall{pixels.data(), width, height, 3 * width};
+    std::vector<unsigned char> data, scaled;
+    // Clears a tile and returns the offset of the pixels of an image
+    // centered on it.
+    auto place = [&](const Tile &tile, size fitted) {
+        for (int y = 0; y < th; y++) {
+            std::fill_n(&pixels[3 * ((tile.y + y) * width + tile.x)], 3 * tw,
+                        0);
+        }
+        int x = tile.x + (tw - static_cast<int>(fitted.width)) / 2;
+        int y = tile.y + (th - static_cast<int>(fitted.height)) / 2;
+        return 3 * (static_cast<size_t>(y) * width + x);
+    };
+    // Fits a source into a tile, keeping at least one pixel
+    auto fit = [&](size source) {
+        size fitted = source.fitted_within(size(tw, th));
+        return size(std::max(fitted.width, 1u), std::max(fitted.height, 1u));
+    };
+
+    catchInterrupts();
+    FramePrinter printer(width / 4, height / 8, flags);
+    // Only the tiles are rendered below, so the gaps between them are
+    // rendered black once here.
+    printer.render(wall);
+    // Files changed less than 100 ms ago are loaded once they settle.
+    auto settled = std::chrono::steady_clock::now();
+    while (!interrupted) {
+        bool rendered = false;
+        for (Tile &tile : tiles) {
+            if (tile.frames) {
+                uint64_t sequence = tile.frames->sequence();
+                if (sequence == tile.shown) continue;
+                PixelView frame = tile.frames->frame(sequence);
+                size fitted = fit(size(frame.width, frame.height));
+                scaled.resize(3 * fitted.width * fitted.height);
+                resample(frame.data, frame.width, frame.height, frame.stride,
+                         3, fitted.width, fitted.height, scaled.data());
+                if (tile.frames->torn(sequence)) continue;
+                tile.shown = sequence;
+                size_t at = place(tile, fitted);
+                for (unsigned int y = 0; y < fitted.height; y++) {
+                    std::copy_n(&scaled[3 * y * fitted.width], 3 * fitted.width,
+                                &pixels[at + 3 * y * width]);
+                }
+            } else {
+                if (!tile.changed ||
+                    std::chrono::steady_clock::now() < settled)
+                    continue;
+                tile.changed = false;
+                if (!readFile(tile.filename, data)) continue;
+                try {
+                    cimg_library::CImg<unsigned char> image = load_rgb_CImg(
+                        data.data(), data.size(), tile.filename.c_str(),
+                        bgColor);
+                    size fitted = fit(size(image));
+                    image.resize(fitted.width, fitted.height, 1, -100, 5);
+                    packPixels(image, 0, 0, fitted.width, fitted.height,
+                               &pixels[place(tile, fitted)], 3 * width);
+                } catch (cimg_library::CImgIOException &e) {
+                    continue;  // The tile keeps its last image.
+                }
+            }
+            printer.render(wall, tile.x / 4, tile.y / 8, (tile.x + tw) / 4,
+                           (tile.y + th) / 8);
+            rendered = true;
+        }
+        if (rendered && !printer.print()) break;
+
+        // Shared memory is polled, files are waited for.
+        bool polling = std::any_of(tiles.begin(), tiles.end(), [](auto &t) {
+            return t.frames || t.changed;
+        });
+        struct pollfd watch = {fd, POLLIN, 0};
+        if (poll(&watch, 1, polling ? 10 : -1) <= 0) continue;
+        readInotifyEvents(fd, [&](int watch, const char *name) {
+            for (Tile &tile : tiles) {
+                if (tile.watch == watch && tile.name == name) {
+                    tile.changed = true;
+                    settled = std::chrono::steady_clock::now() +
+                              std::chrono::milliseconds(100);
+                }
+            }
+        });
+    }
+    close(fd);
+    return EXITCODE_OK;
+}
+#endif
+
+#ifdef _POSIX_VERSION
+/**
+ * @brief An image cut into tiles at its own size and at halved sizes over and
+ * over. Tiles are made when first needed, each from up to four tiles of the
+ * next larger size, and can be made ahead of time on a background thread.
+ */
+class TiledPyramid {
+ public:
+    // The width and height of tiles in pixels
+    static constexpr int TILE_SIZE = 256;
+    // The number of tiles kept, dropping the least recently used ones: a few
+    // screens at the level shown and the finer one prefetched, even on large
+    // terminals, in at most 96 MB.
+    static constexpr size_t MAX_TILES = 512;
+
+    explicit TiledPyramid(cimg_library::CImg<unsigned char> image)
+        : image_(std::move(image)) {
+        sizes_.push_back(size(image_));
+        while (sizes_.back().width > 1 || sizes_.back().height > 1) {
+            size last = sizes_.back();
+            sizes_.push_back(size((last.width + 1) / 2, (last.height + 1) / 2));
+        }
+        worker_ = std::thread(&TiledPyramid::prefetchTiles, this);
+    }
+
+    ~TiledPyramid() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wanted_changed_.notify_all();
+        worker_.join();
+    }
+
+    int levels() const { return sizes_.size(); }
+
+    // The size of the image at a level, halved (and rounded up) per level.
+    size dimensions(int level) const { return sizes_[level]; }
+
+    // The pixels of a tile, as packed rows as wide as the tile. Tiles at the
+    // right and bottom edges are narrower and shorter than TILE_SIZE.
+    std::shared_ptr<const std::vector<unsigned char>> tile(int level, int x,
+                                                           int y) {
+        std::array<int, 3> key{level, x, y};
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (auto found = cached(key)) return found;
+        }
+        // Made without holding the lock, so both threads can make tiles.
+        auto made = std::make_shared<const std::vector<unsigned char>>(
+            makeTile(level, x, y));
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (auto found = cached(key)) return found;  // Made by the other one
+        order_.push_front(key);
+        tiles_.emplace(key, std::make_pair(order_.begin(), made));
+        if (tiles_.size() > MAX_TILES) {
+            tiles_.erase(order_.back());
+            order_.pop_back();
+        }
+        return made;
+    }
+
+    // Makes the given tiles (level, x, y) in that order on the background
+    // thread, forgetting about those asked for before.
+    void prefetch(std::deque<std::array<int, 3>> tiles) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wanted_ = std::move(tiles);
+        wanted_changed_.notify_all();
+    }
+
+ private:
+    using Tile = std::shared_ptr<const std::vector<unsigned char>>;
+
+    // The tile, which becomes the most recently used one, or null if it isn't
+    // cached. Called with mutex_ held.
+    Tile cached(const std::array<int, 3> &key) {
+        auto found = tiles_.find(key);
+        if (found == tiles_.end()) return nullptr;
+        order_.splice(order_.begin(), order_, found->second.first);
+        return found->second.second;
+    }
+
+    std::vector<unsigned char> makeTile(int level, int x, int y) {
+        int width =
+            std::min<int>(TILE_SIZE, sizes_[level].width - x * TILE_SIZE);
+        int height =
+            std::min<int>(TILE_SIZE, sizes_[level].height - y * TILE_SIZE);
+        std::vector<unsigned char> pixels(3 * width * height);
+        unsigned char *out = pixels.data();
+        if (level == 0) {
+            packPixels(image_, x * TILE_SIZE, y * TILE_SIZE, width, height,
+                       out, 3 * width);
+            return pixels;
+        }
+
+        // Each pixel averages 2x2 pixels of the larger level, which are found
+        // in the tiles at twice the coordinates of this one and next to them.
+        int source_width = sizes_[level - 1].width;
+        int source_height = sizes_[level - 1].height;
+        std::shared_ptr<const std::vector<unsigned char>> sources[2][2];
+        for (int sy = 0; sy < 2; sy++) {
+            for (int sx = 0; sx < 2; sx++) {
+                if ((2 * x + sx) * TILE_SIZE < source_width &&
+                    (2 * y + sy) * TILE_SIZE < source_height)
+                    sources[sy][sx] = tile(level - 1, 2 * x + sx, 2 * y + sy);
+            }
+        }
+        auto source = [&](int px, int py) {
+            // Pixels past the edge repeat the last row or column.
+            px = std::min(px, source_width - 1);
+            py = std::min(py, source_height - 1);
+            int tile_width =
+                std::min(TILE_SIZE, source_width - px / TILE_SIZE * TILE_SIZE);
+            const auto &pixels =
+                *sources[py / TILE_SIZE - 2 * y][px / TILE_SIZE - 2 * x];
+            return &pixels[3 * (py % TILE_SIZE * tile_width + px % TILE_SIZE)];
+        };
+        for (int ty = 0; ty < height; ty++) {
+            int py = 2 * (y * TILE_SIZE + ty);
+            for (int tx = 0; tx < width; tx++) {
+                int px = 2 * (x * TILE_SIZE + tx);
+                const unsigned char *a = source(px, py);
+                const unsigned char *b = source(px + 1, py);
+                const unsigned char *c = source(px, py + 1);
+                const unsigned char *d = source(px + 1, py + 1);
+                for (int i = 0; i < 3; i++)
+                    *out++ = (a[i] + b[i] + c[i] + d[i] + 2) / 4;
+            }
+        }
+        return pixels;
+    }
+
+    void prefetchTiles() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wanted_changed_.wait(lock,
+                                 [&] { return stopping_ || !wanted_.empty(); });
+            if (stopping_) break;
+            std::array<int, 3> key = wanted_.front();
+            wanted_.pop_front();
+            if (tiles_.count(key)) continue;
+            lock.unlock();
+            tile(key[0], key[1], key[2]);
+            lock.lock();
+        }
+    }
+
+    cimg_library::CImg<unsigned char> image_;
+    std::vector<size> sizes_;
+    std::mutex mutex_;
+    std::list<std::array<int, 3>> order_;  // Most recently used first
+    std::map<std::array<int, 3>,
+             std::pair<std::list<std::array<int, 3>>::iterator, Tile>>
+        tiles_;
+    std::condition_variable wanted_changed_;
+    std::deque<std::array<int, 3>> wanted_;
+    bool stopping_ = false;
+    std::thread worker_;
+};
+
+// Keys other than characters, as returned by KeyReader::next()
+enum Key {
+    KEY_NONE = 0,
+    KEY_ESCAPE = 27,
+    KEY_UP = 0x100,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_HOME,
+    KEY_END,
+};
+
+/**
+ * @brief Reads key presses from the terminal, which doesn't wait for a
+ * newline or echo them while the reader exists
+ */
+class KeyReader {
+ public:
+    KeyReader() {
+        fd_ = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd_ >= 0 && tcgetattr(fd_, &saved_) == 0) {
+            struct termios raw = saved_;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            raw_ = tcsetattr(fd_, TCSANOW, &raw) == 0;
+        }
+    }
+
+    ~KeyReader() {
+        if (raw_) tcsetattr(fd_, TCSANOW, &saved_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    KeyReader(const KeyReader &) = delete;
+    KeyReader &operator=(const KeyReader &) = delete;
+
+    // Whether there is a terminal to read keys from, which is still open.
+    bool valid() const { return raw_ && !closed_; }
+
+    // Waits up to timeout ms (or forever if negative) for the next key: a
+    // character or one of the Key values. KEY_NONE if there is none, when
+    // interrupted or resized, or for keys that aren't known.
+    int next(int timeout) {
+        if (pending_.empty() && !fill(timeout)) return KEY_NONE;
+        if (pending_[0] != '\x1b') {
+            int key = static_cast<unsigned char>(pending_[0]);
+            pending_.erase(0, 1);
+            return key;
+        }
+        static const std::pair<const char *, int> sequences[] = {
+            {"\x1b[A", KEY_UP},        {"\x1bOA", KEY_UP},
+            {"\x1b[B", KEY_DOWN},      {"\x1bOB", KEY_DOWN},
+            {"\x1b[C", KEY_RIGHT},     {"\x1bOC", KEY_RIGHT},
+            {"\x1b[D", KEY_LEFT},      {"\x1bOD", KEY_LEFT},
+            {"\x1b[5~", KEY_PAGE_UP},  {"\x1b[6~", KEY_PAGE_DOWN},
+            {"\x1b[H", KEY_HOME},      {"\x1bOH", KEY_HOME},
+            {"\x1b[1~", KEY_HOME},     {"\x1b[F", KEY_END},
+            {"\x1bOF", KEY_END},       {"\x1b[4~", KEY_END},
+        };
+        // The rest of an escape sequence follows right away; an escape on
+        // its own is the escape key.
+        while (true) {
+            bool partial = false;
+            for (auto &sequence : sequences) {
+                size_t length = std::strlen(sequence.first);
+                if (pending_.compare(0, length, sequence.first) == 0) {
+                    pending_.erase(0, length);
+                    return sequence.second;
+                }
+                if (pending_.size() < length &&
+                    std::string(sequence.first).compare(0, pending_.size(),
+                                                        pending_) == 0)
+                    partial = true;
+            }
+            if (!partial || !fill(20)) break;
+        }
+        if (pending_.size() == 1) {
+            pending_.clear();
+            return KEY_ESCAPE;
+        }
+        // Skips unknown sequences up to their final character
+        size_t end = pending_[1] == '[' || pending_[1] == 'O'
+                         ? pending_.find_first_of(
+                               "@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`"
+                               "abcdefghijklmnopqrstuvwxyz{|}~",
+                               2)
+                         : 1;
+        pending_.erase(0, end == std::string::npos ? pending_.size() : end + 1);
+        return KEY_NONE;
+    }
+
+ private:
+    bool fill(int timeout) {
+        struct pollfd input = {fd_, POLLIN, 0};
+        if (waitForInput(&input, 1, timeout) <= 0) return false;
+        char buffer[64];
+        ssize_t n = read(fd_, buffer, sizeof(buffer));
+        if (n == 0 || (n < 0 && errno != EINTR)) closed_ = true;
+        if (n <= 0) return false;
+        pending_.append(buffer, n);
+        return true;
+    }
+
+    int fd_ = -1;
+    struct termios saved_;
+    bool raw_ = false;
+    bool closed_ = false;
+    std::string pending_;  // Read, but not returned yet
+};
+
+/**
+ * @brief Show an image on the whole screen, letting the user pan and zoom it
+ * with the keyboard until they quit
+ *
+ * The view is composed from the tiles of a TiledPyramid at the level that
+ * matches the zoom, or from the original pixels when zoomed in further. The
+ * tiles around the view, and those of the next smaller and larger levels, are
+ * made on a background thread while waiting for the next key. Panning by
+ * whole cells moves the rendered cells along, so only the cells coming into
+ * view are rendered. After zooming, all cells are rendered on 'threads'
+ * threads.
+ *
+ * @param filename The image file
+ * @param maxWidth The width of the screen in pixels
+ * @param maxHeight The height of the screen in pixels
+ * @param fitTerminal Whether the screen size is that of the terminal, and
+ * changes with it
+ * @param flags The rendering flags
+ * @param bgColor The background color in case of a transparent image
+ * @param threads The number of threads to render the cells on
+ * @return int The program exit code
+ */
+int exploreImage(const std::string &filename, int maxWidth, int maxHeight,
+                 bool fitTerminal, const int &flags, unsigned char *bgColor,
+                 unsigned int threads) {
+    // Before the pyramid starts its thread
+    if (fitTerminal) catchResizes();
+    // The error below is enough; CImg's message would add to it.
+    cimg_library::cimg::exception_mode(0);
+    std::unique_ptr<TiledPyramid> pyramid;
+    try {
+        FileData file(filename);
+        pyramid = std::make_unique<TiledPyramid>(load_rgb_CImg(
+            file.data(), file.size(),
+            filename == "-" ? nullptr : filename.c_str(), bgColor));
+    } catch (cimg_library::CImgIOException &e) {
+        std::cerr << "Error: '" << filename
+                  << "' has an unrecognized file format" << std::endl;
+        return EXITCODE_DATA_FORMAT_ERROR;
+    }
+    KeyReader keys;
+    if (!keys.valid()) {
+        std::cerr << "Error: --explore needs a terminal to read keys from"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+    }
+
+    constexpr int TILE_SIZE = TiledPyramid::TILE_SIZE;
+    // The view shows the image scaled by 2^-zoom, where negative zoom
+    // enlarges the original pixels. It starts out showing all of the image,
+    // which is as far as it can be zoomed out.
+    constexpr int MIN_ZOOM = -4;
+    int columns, rows, width, height, max_zoom;
+    std::vector<unsigned char> pixels;
+    // Fits the view to the screen. The last row shows where the view is.
+    auto layout = [&]() {
+        columns = std::max(maxWidth / 4, 1);
+        rows = std::max(maxHeight / 8 - 1, 1);
+        width = columns * 4, height = rows * 8;
+        max_zoom = 0;
+        while (max_zoom < pyramid->levels() - 1 &&
+               (pyramid->dimensions(max_zoom).width >
+                    static_cast<unsigned>(width) ||
+                pyramid->dimensions(max_zoom).height >
+                    static_cast<unsigned>(height)))
+            max_zoom++;
+        pixels.resize(3 * width * height);
+    };
+    layout();
+    int zoom = max_zoom;
+    auto zoomed_size = [&](int zoom) {
+        size level = pyramid->dimensions(std::max(zoom, 0));
+        int shift = std::max(-zoom, 0);
+        return size(level.width << shift, level.height << shift);
+    };
+    // The position of the top left corner of the screen in the zoomed image,
+    // negative when the image is centered on a larger screen.
+    int left = 0, top = 0;
+    auto place = [&](int center_x, int center_y) {
+        size image = zoomed_size(zoom);
+        auto clamp = [](int center, int view, int image) {
+            if (image <= view) return -(view - image) / 2;
+            return std::max(0, std::min(center - view / 2, image - view));
+        };
+        left = clamp(center_x, width, image.width);
+        top = clamp(center_y, height, image.height);
+    };
+    place(0, 0);
+
+    auto compose = [&]() {
+        std::fill(pixels.begin(), pixels.end(), 0);
+        int level = std::max(zoom, 0), shift = std::max(-zoom, 0);
+        size image = zoomed_size(zoom);
+        // The part of the screen showing the image
+        int x0 = std::max(-left, 0), y0 = std::max(-top, 0);
+        int x1 = std::min<int>(width, image.width - left);
+        int y1 = std::min<int>(height, image.height - top);
+        size tiles = pyramid->dimensions(level);
+        for (int ty = ((top + y0) >> shift) / TILE_SIZE;
+             ty * TILE_SIZE < static_cast<int>(tiles.height) &&
+             (ty * TILE_SIZE << shift) < top + y1;
+             ty++) {
+            for (int tx = ((left + x0) >> shift) / TILE_SIZE;
+                 tx * TILE_SIZE < static_cast<int>(tiles.width) &&
+                 (tx * TILE_SIZE << shift) < left + x1;
+                 tx++) {
+                auto tile = pyramid->tile(level, tx, ty);
+                int tile_width =
+                    std::min<int>(TILE_SIZE, tiles.width - tx * TILE_SIZE);
+                int tile_height =
+                    std::min<int>(TILE_SIZE, tiles.height - ty * TILE_SIZE);
+                // The part of the screen showing this tile
+                int sx0 = std::max(x0, (tx * TILE_SIZE << shift) - left);
+                int sx1 = std::min(
+                    x1, ((tx * TILE_SIZE + tile_width) << shift) - left);
+                int sy0 = std::max(y0, (ty * TILE_SIZE << shift) - top);
+                int sy1 = std::min(
+                    y1, ((ty * TILE_SIZE + tile_height) << shift) - top);
+                for (int y = sy0; y < sy1; y++) {
+                    const unsigned char *row =
+                        tile->data() +
+                        3 * (((top + y) >> shift) - ty * TILE_SIZE) *
+                            tile_width;
+                    unsigned char *out = &pixels[3 * (y * width + sx0)];
+                    if (shift == 0) {
+                        std::memcpy(out,
+                                    row + 3 * (left + sx0 - tx * TILE_SIZE),
+                                    3 * (sx1 - sx0));
+                        continue;
+                    }
+                    for (int x = sx0; x < sx1; x++, out += 3) {
+                        std::memcpy(
+                            out,
+                            row + 3 * (((left + x) >> shift) - tx * TILE_SIZE),
+                            3);
+                    }
+                }
+            }
+        }
+    };
+    // Asks for the tiles next to the view, then for those of the next
+    // smaller and larger levels, so panning and zooming find them ready.
+    auto prefetch = [&]() {
+        std::deque<std::array<int, 3>> wanted;
+        int shown_level = std::max(zoom, 0);
+        for (int level : {shown_level, shown_level + 1, shown_level - 1}) {
+            if (level < 0 || level >= pyramid->levels()) continue;
+            int shift = zoom - level;  // Screen to level pixels
+            auto to_tile = [&](int pixel) {
+                pixel = shift < 0 ? pixel >> -shift : pixel << shift;
+                return pixel / TILE_SIZE;
+            };
+            size tiles = pyramid->dimensions(level);
+            int tx0 = std::max(to_tile(std::max(left, 0)) - 1, 0);
+            int ty0 = std::max(to_tile(std::max(top, 0)) - 1, 0);
+            int tx1 = std::min<int>(to_tile(std::max(left + width, 0)) + 1,
+                                    (tiles.width - 1) / TILE_SIZE);
+            int ty1 = std::min<int>(to_tile(std::max(top + height, 0)) + 1,
+                                    (tiles.height - 1) / TILE_SIZE);
+            for (int ty = ty0; ty <= ty1; ty++) {
+                for (int tx = tx0; tx <= tx1; tx++)
+                    wanted.push_back({level, tx, ty});
+            }
+        }
+        pyramid->prefetch(std::move(wanted));
+    };
+
+    catchInterrupts();
+    auto printer = std::make_unique<FramePrinter>(columns, rows, flags);
+    int shown_zoom = zoom, shown_left = left, shown_top = top;
+    bool first = true;
+    while (!interrupted) {
+        // Cells that are still on the screen after panning are kept.
+        int dx = left - shown_left, dy = top - shown_top;
+        if (!first && zoom == shown_zoom && dx % 4 == 0 && dy % 8 == 0)
+            printer->shift(-dx / 4, -dy / 8);
+        first = false;
+        shown_zoom = zoom, shown_left = left, shown_top = top;
+        compose();
+        printer->render(PixelView{pixels.data(), width, height, 3 * width},
+                        threads);
+        if (!printer->print()) break;
+        std::ostringstream status;
+        size image = pyramid->dimensions(0);
+        status << filename << "  " << image.width << "x" << image.height
+               << "  " << std::ldexp(100, -zoom)
+               << "%  arrows/hjkl: pan  +/-: zoom  0: fit  q: quit";
+        std::string line = status.str().substr(0, columns);
+        write_output("\x1b[" + std::to_string(rows + 1) + ";1H\x1b[0m" + line +
+                     "\x1b[K");
+        prefetch();
+
+        int key;
+        while ((key = keys.next(-1)) == KEY_NONE && !interrupted &&
+               !resized && keys.valid()) {
+        }
+        if (!keys.valid()) break;
+        int center_x = left + width / 2, center_y = top + height / 2;
+        if (resized) {
+            // The view keeps its center, and is painted again in full.
+            resized = 0;
+            terminalSize(maxWidth, maxHeight);
+            layout();
+            if (zoom > max_zoom) {
+                center_x >>= zoom - max_zoom, center_y >>= zoom - max_zoom;
+                zoom = max_zoom;
+            }
+            place(center_x, center_y);
+            printer.reset();
+            printer = std::make_unique<FramePrinter>(columns, rows, flags);
+            first = true;
+            continue;
+        }
+        int step_x = std::max(width / 16 * 4, 4);
+        int step_y = std::max(height / 32 * 8, 8);
+        if (key == 'q' || key == KEY_ESCAPE) {
+            break;
+        } else if (key == KEY_LEFT || key == 'h') {
+            place(center_x - step_x, center_y);
+        } else if (key == KEY_RIGHT || key == 'l') {
+            place(center_x + step_x, center_y);
+        } else if (key == KEY_UP || key == 'k') {
+            place(center_x, center_y - step_y);
+        } else if (key == KEY_DOWN || key == 'j') {
+            place(center_x, center_y + step_y);
+        } else if ((key == '+' || key == '=') && zoom > MIN_ZOOM) {
+            zoom--;
+            place(2 * center_x, 2 * center_y);
+        } else if (key == '-' && zoom < max_zoom) {
+            zoom++;
+            place(center_x / 2, center_y / 2);
+        } else if (key == '0') {
+            zoom = max_zoom;
+            place(0, 0);
+        }
+    }
+    return EXITCODE_OK;
+}
+
+/**
+ * @brief Ask a source of file names for more of them, as they are needed
+ *
+ * @param next_file Produces the next file name like the file name sources in
+ * main(), returning false when there are no more
+ * @param count The number of names wanted in total
+ * @param names Receives the names, up to 'count' of them
+ * @param listed Set once there are no more names
+ */
+template <typename NextFile>
+void listFiles(NextFile &next_file, size_t count,
+               std::vector<std::string> &names, bool &listed) {
+    std::string name;
+    std::unique_ptr<FileData> file;
+    while (!listed && names.size() < count) {
+        if (next_file(name, file)) {
+            names.push_back(name);
+        } else {
+            listed = true;
+        }
+    }
+}
 
-void printTermColor(const int &flags, int r, int g, int b) {
-    r = clamp_byte(r);
-    g = clamp_byte(g);
-    b = clamp_byte(b);
+/**
+ * @brief Keeps the cells of the most recently used thumbnails, up to a fixed
+ * number of them
+ */
+class ThumbnailCache {
+ public:
+    using Cells = std::shared_ptr<const std::vector<CharData>>;
 
-    bool bg = (flags & FLAG_BG) != 0;
+    explicit ThumbnailCache(size_t capacity) : capacity_(capacity) {}
 
-    if ((flags & FLAG_MODE_256) == 0) {
-        std::cout << (bg ? "\x1b[48;2;" : "\x1b[38;2;") << r << ';' << g << ';'
-                  << b << 'm';
-        return;
+    // The cells of a thumbnail, which becomes the most recently used one;
+    // null if they aren't cached.
+    Cells find(size_t index) {
+        auto found = entries_.find(index);
+        if (found == entries_.end()) return nullptr;
+        order_.splice(order_.begin(), order_, found->second.first);
+        return found->second.second;
     }
 
-    int ri = best_index(r, COLOR_STEPS, COLOR_STEP_COUNT);
-    int gi = best_index(g, COLOR_STEPS, COLOR_STEP_COUNT);
-    int bi = best_index(b, COLOR_STEPS, COLOR_STEP_COUNT);
-
-    int rq = COLOR_STEPS[ri];
-    int gq = COLOR_STEPS[gi];
-    int bq = COLOR_STEPS[bi];
+    // Adds the cells of a thumbnail, dropping the least recently used one if
+    // the cache is full.
+    void insert(size_t index, Cells cells) {
+        if (find(index)) {
+            entries_[index].second = std::move(cells);
+            return;
+        }
+        order_.push_front(index);
+        entries_.emplace(index,
+                         std::make_pair(order_.begin(), std::move(cells)));
+        if (entries_.size() > capacity_) {
+            entries_.erase(order_.back());
+            order_.pop_back();
+        }
+    }
 
-    int gray =
-        static_cast<int>(std::round(r * 0.2989f + g * 0.5870f + b * 0.1140f));
+    // Drops all thumbnails, as when they are to be shown at another size,
+    // and keeps up to 'capacity' from now on.
+    void clear(size_t capacity) {
+        capacity_ = capacity;
+        order_.clear();
+        entries_.clear();
+    }
 
-    int gri = best_index(gray, GRAYSCALE_STEPS, GRAYSCALE_STEP_COUNT);
-    int grq = GRAYSCALE_STEPS[gri];
+ private:
+    size_t capacity_;
+    std::list<size_t> order_;  // Most recently used first
+    std::unordered_map<size_t, std::pair<std::list<size_t>::iterator, Cells>>
+        entries_;
+};
 
-    int color_index;
-    if (0.3 * sqr(rq - r) + 0.59 * sqr(gq - g) + 0.11 * sqr(bq - b) <
-        0.3 * sqr(grq - r) + 0.59 * sqr(grq - g) + 0.11 * sqr(grq - b)) {
-        color_index = 16 + 36 * ri + 6 * gi + bi;
-    } else {
-        color_index = 232 + gri;  // 1..24 -> 232..255
+/**
+ * @brief Show the thumbnails of many images on the whole screen, scrolling
+ * through them with the keyboard until the user quits
+ *
+ * Only the thumbnails on the screen, and those a screen's height above and
+ * below, are decoded and rendered, on up to 'threads' threads. Their cells
+ * are kept in a ThumbnailCache of four screens' worth, so going back is
+ * instant while memory doesn't grow with the number of images. File names
+ * are only asked for once they are about to be shown.
+ *
+ * @param next_file The source of file names, asked through listFiles() for
+ * those of the rows scrolled to, and for all of them on End
+ * @param columns The number of thumbnails per row
+ * @param maxWidth The width of the screen in pixels
+ * @param maxHeight The height of the screen in pixels
+ * @param fitTerminal Whether the screen size is that of the terminal, and
+ * changes with it, in which case catchResizes() must have been called before
+ * any thread producing file names was started
+ * @param flags The rendering flags
+ * @param bgColor The background color in case of a transparent image
+ * @param threads The number of thumbnails decoded at the same time
+ * @return int The program exit code
+ */
+template <typename NextFile>
+int browseThumbnails(NextFile next_file, int columns, int maxWidth,
+                     int maxHeight, bool fitTerminal, const int &flags,
+                     unsigned char *bgColor, unsigned int threads) {
+    KeyReader keys;
+    if (!keys.valid()) {
+        std::cerr << "Error: --browse needs a terminal to read keys from"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
     }
-    std::cout << (bg ? "\x1B[48;5;" : "\u001B[38;5;") << color_index << "m";
-}
-
-void printCodepoint(int codepoint) {
-    if (codepoint < 128) {
-        std::cout << static_cast<char>(codepoint);
-    } else if (codepoint < 0x7ff) {
-        std::cout << static_cast<char>(0xc0 | (codepoint >> 6));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
-    } else if (codepoint < 0xffff) {
-        std::cout << static_cast<char>(0xe0 | (codepoint >> 12));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
-    } else if (codepoint < 0x10ffff) {
-        std::cout << static_cast<char>(0xf0 | (codepoint >> 18));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
-    } else {
-        std::cerr << "ERROR";
+    // Files that can't be decoded are skipped; CImg would print its messages
+    // over the thumbnails.
+    cimg_library::cimg::exception_mode(0);
+    // Laid out as in 'dir' mode, each row of thumbnails followed by their
+    // names and an empty line. The last line of the screen shows where the
+    // view is.
+    int screen_columns, cw, ch, row_height, rows;
+    size_t per_screen;
+    // Fits the layout to the screen; false (keeping the last layout) if the
+    // screen is too small.
+    auto layout = [&]() {
+        int screen_rows = maxHeight / 8 - 1;
+        int width = (maxWidth / 4 - 2 * (columns - 1)) / columns;
+        int height = std::min(width / 2, screen_rows - 2);
+        if (width <= 0 || height <= 0) return false;
+        screen_columns = maxWidth / 4;
+        cw = width, ch = height;
+        row_height = ch + 2;
+        rows = screen_rows / row_height;
+        per_screen = static_cast<size_t>(rows) * columns;
+        return true;
+    };
+    if (!layout()) {
+        std::cerr << "Error: The terminal is too small for " << columns
+                  << " columns of thumbnails" << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
     }
-}
 
-void printImage(const cimg_library::CImg<unsigned char> &image,
-                const int &flags) {
-    GetPixelFunction get_pixel = [&](int x, int y) -> unsigned long {
-        return (((unsigned long) image(x, y, 0, 0)) << 16)
-            | (((unsigned long) image(x, y, 0, 1)) << 8)
-            | (((unsigned long) image(x, y, 0, 2)));
+    std::vector<std::string> names;
+    bool listed = false;
+    // Renders a thumbnail of cw x ch cells, which are passed along as the
+    // layout may change while it is being decoded.
+    auto load_thumbnail = [&](const std::string &name, int cw, int ch) {
+        int tw = cw * 4, th = ch * 8;
+        auto cells = std::make_shared<std::vector<CharData>>();
+        try {
+            FileData file(name);
+            cimg_library::CImg<unsigned char> image =
+                load_rgb_CImg(file.data(), file.size(),
+                              name == "-" ? nullptr : name.c_str(), bgColor);
+            size fitted = size(image).fitted_within(size(tw, th));
+            image.resize(std::max(fitted.width, 1u),
+                         std::max(fitted.height, 1u), 1, -100, 5);
+            std::vector<unsigned char> pixels(3 * tw * th, 0);
+            int x0 = (tw - image.width()) / 2, y0 = (th - image.height()) / 2;
+            packPixels(image, 0, 0, image.width(), image.height(),
+                       &pixels[3 * (y0 * tw + x0)], 3 * tw);
+            PixelView view{pixels.data(), tw, th, 3 * tw};
+            cells->reserve(cw * ch);
+            for (int y = 0; y < ch; y++) {
+                for (int x = 0; x < cw; x++)
+                    cells->push_back(renderCell(view, x * 4, y * 8, flags));
+            }
+        } catch (std::exception &e) {
+            // Probably no image; shown as an empty tile.
+        }
+        return ThumbnailCache::Cells(std::move(cells));
     };
 
-    CharData lastCharData;
-    for (int y = 0; y <= image.height() - 8; y += 8) {
-        for (int x = 0; x <= image.width() - 4; x += 4) {
-            CharData charData =
-                flags & FLAG_NOOPT
-                    ? createCharData(get_pixel, x, y, 0x2584, 0x0000ffff)
-                    : findCharData(get_pixel, x, y, flags);
-            if (x == 0 || charData.bgColor != lastCharData.bgColor)
-                printTermColor(flags | FLAG_BG, charData.bgColor[0],
-                               charData.bgColor[1], charData.bgColor[2]);
-            if (x == 0 || charData.fgColor != lastCharData.fgColor)
-                printTermColor(flags | FLAG_FG, charData.fgColor[0],
-                               charData.fgColor[1], charData.fgColor[2]);
-            printCodepoint(charData.codePoint);
-            lastCharData = charData;
+    ThumbnailCache cache(4 * per_screen);
+    std::map<size_t, std::future<ThumbnailCache::Cells>> loading;
+    CharData blank;
+    blank.codePoint = ' ';
+    std::vector<CharData> screen(screen_columns * rows * row_height);
+    size_t first_row = 0;
+    bool changed = true;
+
+    catchInterrupts();
+    auto printer = std::make_unique<FramePrinter>(screen_columns,
+                                                  rows * row_height, flags);
+    while (!interrupted) {
+        size_t first = first_row * columns;
+        listFiles(next_file, first + 2 * per_screen, names, listed);
+        // The thumbnails on the screen come first, then those below and
+        // above it.
+        size_t above = first > per_screen ? first - per_screen : 0;
+        std::vector<std::pair<size_t, size_t>> ranges = {
+            {first, first + per_screen},
+            {first + per_screen, first + 2 * per_screen},
+            {above, first}};
+        for (auto &range : ranges) {
+            for (size_t i = range.first;
+                 i < std::min(range.second, names.size()) &&
+                 loading.size() < threads;
+                 i++) {
+                if (loading.count(i) || cache.find(i)) continue;
+                loading.emplace(i, std::async(std::launch::async,
+                                              load_thumbnail, names[i], cw,
+                                              ch));
+            }
         }
-        std::cout << "\x1b[0m" << std::endl;
-    }
-}
 
-struct size {
-    size(unsigned int in_width, unsigned int in_height)
-        : width(in_width), height(in_height) {}
-    explicit size(cimg_library::CImg<unsigned int> img)
-        : width(img.width()), height(img.height()) {}
-    unsigned int width;
-    unsigned int height;
-    size scaled(double scale) { return size(width * scale, height * scale); }
-    size fitted_within(size container) {
-        double scale = std::min(container.width / static_cast<double>(width),
-                                container.height / static_cast<double>(height));
-        return scaled(scale);
+        if (changed) {
+            std::fill(screen.begin(), screen.end(), blank);
+            for (size_t i = first; i < std::min(first + per_screen,
+                                                names.size());
+                 i++) {
+                int x0 = (i - first) % columns * (cw + 2);
+                int y0 = (i - first) / columns * row_height;
+                ThumbnailCache::Cells cells = cache.find(i);
+                if (cells && !cells->empty()) {
+                    for (int y = 0; y < ch; y++) {
+                        std::copy_n(&(*cells)[y * cw], cw,
+                                    &screen[(y0 + y) * screen_columns + x0]);
+                    }
+                }
+                const std::string &name = names[i];
+                auto cut = name.find_last_of("/");
+                std::string label =
+                    cut == std::string::npos ? name : name.substr(cut + 1);
+                CharData *text = &screen[(y0 + ch) * screen_columns + x0];
+                for (int x = 0; x < cw && x < static_cast<int>(label.size());
+                     x++) {
+                    text[x] = blank;
+                    text[x].fgColor = {192, 192, 192};
+                    // Shows other than printable ASCII as '?'
+                    text[x].codePoint =
+                        label[x] >= ' ' && label[x] < 0x7f ? label[x] : '?';
+                }
+            }
+            printer->place(screen.data(), screen_columns, rows * row_height,
+                           0, 0);
+            if (!printer->print()) break;
+            std::ostringstream status;
+            status << std::min(first + 1, names.size()) << "-"
+                   << std::min(first + per_screen, names.size()) << " of "
+                   << names.size() << (listed ? "" : "+")
+                   << "  arrows/PgUp/PgDn/Home/End: scroll  q: quit";
+            std::string line = status.str().substr(0, screen_columns);
+            write_output("\x1b[" + std::to_string(rows * row_height + 1) +
+                         ";1H\x1b[0m" + line + "\x1b[K");
+            changed = false;
+        }
+
+        // Waits for a key, or for a thumbnail to be done.
+        int key = keys.next(loading.empty() ? -1 : 10);
+        if (!keys.valid()) break;
+        for (auto it = loading.begin(); it != loading.end();) {
+            if (it->second.wait_for(std::chrono::seconds(0)) !=
+                std::future_status::ready) {
+                ++it;
+                continue;
+            }
+            if (it->first >= first && it->first < first + per_screen)
+                changed = true;
+            cache.insert(it->first, it->second.get());
+            it = loading.erase(it);
+        }
+        if (resized) {
+            // The thumbnails are made again at the new size, and the screen
+            // is painted again in full.
+            resized = 0;
+            terminalSize(maxWidth, maxHeight);
+            layout();
+            loading.clear();  // Waits for those still being decoded
+            cache.clear(4 * per_screen);
+            screen.assign(screen_columns * rows * row_height, blank);
+            printer.reset();
+            printer = std::make_unique<FramePrinter>(screen_columns,
+                                                     rows * row_height, flags);
+            changed = true;
+        }
+
+        size_t previous = first_row;
+        if (key == 'q' || key == KEY_ESCAPE) {
+            break;
+        } else if (key == KEY_UP || key == 'k') {
+            if (first_row > 0) first_row--;
+        } else if (key == KEY_DOWN || key == 'j') {
+            first_row++;
+        } else if (key == KEY_PAGE_UP) {
+            first_row -= std::min<size_t>(first_row, rows);
+        } else if (key == KEY_PAGE_DOWN || key == ' ') {
+            first_row += rows;
+        } else if (key == KEY_HOME || key == 'g') {
+            first_row = 0;
+        } else if (key == KEY_END || key == 'G') {
+            listFiles(next_file, SIZE_MAX, names, listed);
+            first_row = names.size();
+        }
+        // The last row of thumbnails can't be scrolled past the bottom.
+        if (first_row > previous)
+            listFiles(next_file, (first_row + rows) * columns, names, listed);
+        size_t total_rows = (names.size() + columns - 1) / columns;
+        first_row = std::min(first_row,
+                             total_rows > static_cast<size_t>(rows)
+                                 ? total_rows - rows
+                                 : 0);
+        if (first_row != previous) changed = true;
     }
-};
-std::ostream &operator<<(std::ostream &stream, size sz) {
-    stream << sz.width << "x" << sz.height;
-    return stream;
+    return EXITCODE_OK;
 }
 
 /**
- * @brief Wrapper around CImg<T>(const char*) constructor
- * that always returns a CImg image with 3 channels (RGB)
+ * @brief Show images one at a time on the whole screen, going to the next
+ * one after a delay or on a key press, until the last one or until the user
+ * quits
  *
- * @param filename The file to construct a CImg object on
- * @param bgColor  The color to use as the background in case of a transparent image
- * @return cimg_library::CImg<unsigned char> Constructed CImg RGB image
+ * While an image is shown, the next and previous ones are decoded and
+ * rendered to complete frames on worker threads, so going to one of them
+ * only takes writing that frame.
+ *
+ * @param next_file The source of file names, asked through listFiles() for
+ * one name past the image shown, so the next one can be decoded ahead
+ * @param seconds The time each image is shown for, or 0 to only go on when
+ * a key is pressed
+ * @param maxWidth The width of the screen in pixels
+ * @param maxHeight The height of the screen in pixels
+ * @param flags The rendering flags
+ * @param bgColor The background color in case of a transparent image
+ * @return int The program exit code
  */
-cimg_library::CImg<unsigned char> load_rgb_CImg(const char *const &filename,
-                                                unsigned char* bgColor) {
-    cimg_library::CImg<unsigned char> image(filename);
-    // Regular image, do nothing special
-    if (image.spectrum() == 3) {
-        if (!(bgColor[0] == 255 && bgColor[1] == 255 && bgColor[2] == 255)) {
-          std::cerr << "Warning: Background color argument '-C' was specified, "
-                       "but only PNGs and GIFs transparencies are supported "
-                       "at the moment. Using white background instead."
-              << std::endl;
-        }
-        return image;
+template <typename NextFile>
+int playSlideshow(NextFile next_file, double seconds, int maxWidth,
+                  int maxHeight, const int &flags, unsigned char *bgColor) {
+    KeyReader keys;
+    bool interactive = keys.valid();
+    if (!interactive && seconds <= 0) {
+        std::cerr << "Error: --slideshow needs a terminal to read keys from, "
+                     "or a delay"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
     }
+    // The last line of the screen shows which image this is.
+    int rows = std::max(maxHeight / 8 - 1, 1);
+    maxHeight = rows * 8;
 
-    cimg_library::CImg<unsigned char> rgb_image(
-        image.width(), image.height(), image.depth(), 3);
+    // Errors are shown in the status line; CImg's own messages would be
+    // printed over the image.
+    cimg_library::cimg::exception_mode(0);
+    std::vector<std::string> names;
+    bool listed = false;
+    auto render_frame = [&](const std::string &name) {
+        std::string frame = "\x1b[H\x1b[2J";
+        try {
+            FileData file(name);
+            cimg_library::CImg<unsigned char> image =
+                load_rgb_CImg(file.data(), file.size(),
+                              name == "-" ? nullptr : name.c_str(), bgColor);
+            if (image.width() > maxWidth || image.height() > maxHeight) {
+                size new_size =
+                    size(image).fitted_within(size(maxWidth, maxHeight));
+                image.resize(new_size.width, new_size.height, -100, -100, 5);
+            }
+            renderImage(frame, image, flags);
+        } catch (std::exception &e) {
+            frame += "'" + name + "' has an unrecognized file format";
+        }
+        return frame;
+    };
 
-    if (image.spectrum() == 1) {
-        // Greyscale. Just copy greyscale data to all channels
-        for (unsigned int chn = 0; chn < 3; chn++)
-            rgb_image.draw_image(0, 0, 0, chn, image);
-    } else if (image.spectrum() == 4) {
-        // Transparent image, fill background then draw image over
-        for (unsigned int chn = 0; chn < 3; chn++)
-            rgb_image.get_shared_channel(chn).fill(bgColor[chn]);
-        rgb_image.draw_image(0, 0, image.get_shared_channels(0, 2),
-                image.get_shared_channel(3), 1, 255);
+    // The frames of the current image and those next to it, by index
+    std::map<size_t, std::shared_future<std::string>> frames;
+    size_t current = 0;
+    int ret = EXITCODE_OK;
+
+    catchInterrupts();
+    write_output("\x1b[?25l");  // Hide cursor
+    while (!interrupted && output_ok()) {
+        listFiles(next_file, current + 2, names, listed);
+        if (names.empty()) {
+            std::cerr << "Error: No images to show" << std::endl;
+            ret = EXITCODE_NO_INPUT_ERROR;
+            break;
+        }
+        size_t first = current > 0 ? current - 1 : 0;
+        size_t last = std::min(current + 1, names.size() - 1);
+        for (auto it = frames.begin(); it != frames.end();) {
+            if (it->first < first || it->first > last) {
+                it = frames.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // The current image first, in case it hasn't been prefetched
+        for (size_t i : {current, current + 1, current - 1}) {
+            if (i >= first && i <= last && !frames.count(i))
+                frames.emplace(i, std::async(std::launch::async,
+                                             render_frame, names[i]));
+        }
+        std::ostringstream status;
+        status << names[current] << "  " << current + 1 << " of "
+               << names.size() << (listed ? "" : "+");
+        if (interactive)
+            status << "  arrows/space: next or previous image  q: quit";
+        std::string line = status.str().substr(0, maxWidth / 4);
+        auto shown = std::chrono::steady_clock::now();
+        // The frame is only waited for if it wasn't prefetched in time.
+        write_output(frames[current].get() + "\x1b[" +
+                     std::to_string(rows + 1) + ";1H\x1b[0m" + line +
+                     "\x1b[K");
+
+        // Waits for a key, or until the next image is due.
+        int key = KEY_NONE;
+        while (key == KEY_NONE && !interrupted) {
+            int timeout = -1;
+            if (seconds > 0) {
+                auto due = shown + std::chrono::duration<double>(seconds);
+                auto left = std::chrono::duration_cast<
+                    std::chrono::milliseconds>(
+                    due - std::chrono::steady_clock::now());
+                if (left.count() <= 0) {
+                    key = ' ';
+                    break;
+                }
+                timeout = left.count();
+            }
+            key = keys.next(timeout);
+            if (interactive && !keys.valid()) key = 'q';
+        }
+        if (key == 'q' || key == KEY_ESCAPE) {
+            break;
+        } else if (key == ' ' || key == 'n' || key == KEY_RIGHT ||
+                   key == KEY_DOWN || key == KEY_PAGE_DOWN) {
+            // Past the last image, a slideshow ends.
+            if (current + 1 < names.size()) {
+                current++;
+            } else if (seconds > 0) {
+                break;
+            }
+        } else if ((key == 'p' || key == 127 || key == KEY_LEFT ||
+                    key == KEY_UP || key == KEY_PAGE_UP) &&
+                   current > 0) {
+            current--;
+        } else if (key == KEY_HOME) {
+            current = 0;
+        } else if (key == KEY_END) {
+            listFiles(next_file, SIZE_MAX, names, listed);
+            current = names.size() - 1;
+        }
     }
-    return rgb_image;
+    std::cout << "\x1b[0m\x1b[?25h" << std::endl;  // Show cursor
+    return ret;
 }
+#endif
 
 // Implements --help
 void printUsage() {
     std::cerr << R"(
 Terminal Image Viewer v1.3
 usage: tiv [options] <image> [<image>...]
+Use - as <image> to read an image from stdin.
 -0        : No block character adjustment, always use top half block char.
 -2, --256 : Use 256-bit colors. Needed to display properly on macOS Terminal.
 -c <num>  : Number of thumbnail columns in 'dir' mode (3 by default).
 -d, --dir : Force 'dir' mode. Automatically selected for more than one input.
 -f, --full: Force 'full' mode. Automatically selected for one input.
+-r        : Recurse into directories (in parallel), showing only files that
+            look like images.
 --help    : Display this help text.
 -h <num>  : Set the maximum output height to <num> lines.
+-j <num>  : Number of decoding threads. Defaults to $TIV_THREADS or the
+            available CPUs (honoring affinity and cgroup CPU quota).
+--read-ahead <num>: Number of files prefetched ahead of decoding in 'dir'
+            mode (8 by default, 0 to disable), out of those whose names are
+            known already.
 -w <num>  : Set the maximum output width to <num> characters.
 -C <hex>  : Use hex color (0xFFFFFF (White) by default) as background for PNG/GIF.
--x        : Use new Unicode Teletext/legacy characters (experimental).)"
+-x        : Use new Unicode Teletext/legacy characters (experimental).
+--animate : Play animated GIFs in 'full' mode instead of showing their first
+            frame.
+--raw <w>x<h>: Play raw rgb24 video frames of the given size from stdin,
+            e.g. from ffmpeg -f rawvideo -pix_fmt rgb24 -
+--y4m     : Play YUV4MPEG2 video from stdin, e.g. from ffmpeg -f yuv4mpegpipe -
+--fps <num>: Frame rate for --raw and --y4m video; late frames are skipped.
+            By default, raw frames are shown as fast as they arrive, and
+            YUV4MPEG2 streams at their own rate.
+--shm <name>,<w>x<h>: Show the latest rgb24 frame of the given size published
+            to a POSIX shared memory ring buffer, see tiv_shm.h. May be given
+            more than once with --wall.
+--hysteresis <num>: Keep a cell's character from the previous video frame
+            unless the best one matches <num> pixels better (0 by default).
+            Reduces flicker and output for noisy video.
+--watch   : Show the image again whenever its file changes, or the terminal is
+            resized (Linux only).
+--progressive: Show a quick preview of each image in 'full' mode first, then
+            the cells that look different with the full character search,
+            if the image fits on the terminal.
+--slideshow <num>: Show the images one at a time on the whole screen, each for
+            <num> seconds, or until a key is pressed if 0.
+--browse  : Show the thumbnails of 'dir' mode on the whole screen, scrolling
+            with the arrow keys, PgUp/PgDn and Home/End, quitting with q.
+--explore : Show one image on the whole screen to pan (arrows or hjkl) and
+            zoom (+ and -) with the keyboard, quitting with q.
+--wall    : Show all images and --shm sources at once in a grid of -c columns,
+            updating each tile when its source changes (Linux only).
+--follow <dir>: Show the images in <dir> in 'dir' mode, then keep adding the
+            ones written to it until interrupted (Linux only).
+--stats   : Report the number of frames and bytes sent when playing video or
+            animations.
+--stdin   : Read additional file names from stdin, one per line.
+--stdin0  : Read additional NUL-separated file names from stdin,
+            e.g. from 'find -print0'.)"
               << std::endl;
 }
 
-enum Mode { AUTO, THUMBNAILS, FULL_SIZE };
+enum Mode {
+    AUTO,
+    THUMBNAILS,
+    FULL_SIZE,
+    RAW_VIDEO,
+    Y4M_VIDEO,
+    SHARED_MEMORY
+};
 
 int main(int argc, char *argv[]) {
     std::ios::sync_with_stdio(false);  // apparently makes printing faster
+#ifdef _POSIX_VERSION
+    // Detect a closed stdout through write errors instead of being killed.
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
     bool detectSize = true;
 
     // Platform-specific implementations for determining console size, better
@@ -255,8 +3674,28 @@ int main(int argc, char *argv[]) {
                        // see https://stackoverflow.com/a/14295472
     Mode mode = AUTO;  // either THUMBNAIL or FULL_SIZE
     int columns = 3;
+    unsigned int threads = 0;  // 0: TIV_THREADS or default_thread_count()
+    unsigned int read_ahead = 8;
+    int videoWidth = 0, videoHeight = 0;  // Frame size for --raw and --shm
+    std::string shmName;
+    bool animate = false;  // Play animated GIFs
+    double fps = 0;  // Frame rate of raw video, overriding that of Y4M
+    int hysteresis = 0;  // Keeping characters across video frames
+    bool watch = false;  // Show the image again when it changes
+    std::string follow;  // Directory whose new images are added as they come
+    bool wall = false;  // Show all sources at once, updating them live
+    bool explore = false;  // Pan and zoom one image with the keyboard
+    bool browse = false;  // Scroll through thumbnails with the keyboard
+    double slideshow = -1;  // Seconds per image, 0 to wait for keys
+    bool progressive = false;  // Show a preview first in 'full' mode
+    std::vector<std::pair<std::string, size>> shm_sources;  // For --wall
 
+    std::vector<std::string> inputs;  // Files and directories, as given
     std::vector<std::string> file_names;
+    std::vector<std::string> directories;  // Walked recursively with -r
+    bool recursive = false;
+    bool read_stdin = false;  // Stream further file names from stdin
+    char stdin_delimiter = '\n';
     int ret = EXITCODE_OK;  // The return code for the program
 
     if (argc <= 1) {
@@ -275,6 +3714,68 @@ int main(int argc, char *argv[]) {
                 std::cerr << "Error: -c requires a number" << std::endl;
                 ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
             }
+        } else if (arg == "-j") {
+            if (i < argc - 1) {
+                threads = std::max(std::stoi(argv[++i]), 1);
+            } else {
+                std::cerr << "Error: -j requires a number" << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "--read-ahead") {
+            if (i < argc - 1) {
+                read_ahead = std::max(std::stoi(argv[++i]), 0);
+            } else {
+                std::cerr << "Error: --read-ahead requires a number"
+                          << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "-r") {
+            recursive = true;
+        } else if (arg == "--animate") {
+            animate = true;
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--progressive") {
+            progressive = true;
+        } else if (arg == "--slideshow") {
+            if (i < argc - 1) {
+                slideshow = std::max(std::stod(argv[++i]), 0.0);
+            } else {
+                std::cerr << "Error: --slideshow requires a number"
+                          << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "--browse") {
+            browse = true;
+        } else if (arg == "--explore") {
+            explore = true;
+        } else if (arg == "--wall") {
+            wall = true;
+        } else if (arg == "--follow") {
+            if (i < argc - 1) {
+                follow = argv[++i];
+            } else {
+                std::cerr << "Error: --follow requires a directory"
+                          << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "--stats") {
+            flags |= FLAG_STATS;
+        } else if (arg == "--hysteresis") {
+            if (i < argc - 1) {
+                hysteresis = std::min(std::max(std::stoi(argv[++i]), 0), 32);
+            } else {
+                std::cerr << "Error: --hysteresis requires a number"
+                          << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "--fps") {
+            if (i < argc - 1) {
+                fps = std::max(std::stod(argv[++i]), 0.0);
+            } else {
+                std::cerr << "Error: --fps requires a number" << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
         } else if (arg == "-d" || arg == "--dir") {
             mode = THUMBNAILS;
         } else if (arg == "-f" || arg == "--full") {
@@ -306,41 +3807,79 @@ int main(int argc, char *argv[]) {
             }
         } else if (arg == "-x") {
             flags |= FLAG_TELETEXT;
-        } else if (arg[0] == '-') {
+        } else if (arg == "--raw") {
+            if (i < argc - 1 && std::sscanf(argv[++i], "%dx%d", &videoWidth,
+                                            &videoHeight) == 2) {
+                mode = RAW_VIDEO;
+            } else {
+                std::cerr << "Error: --raw requires a frame size like 640x480"
+                          << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "--y4m") {
+            mode = Y4M_VIDEO;
+        } else if (arg == "--shm") {
+            std::string spec = i < argc - 1 ? argv[++i] : "";
+            size_t comma = spec.find_last_of(',');
+            if (comma != std::string::npos &&
+                std::sscanf(spec.c_str() + comma + 1, "%dx%d", &videoWidth,
+                            &videoHeight) == 2 &&
+                videoWidth > 0 && videoHeight > 0) {
+                shmName = spec.substr(0, comma);
+                shm_sources.emplace_back(shmName,
+                                         size(videoWidth, videoHeight));
+                mode = SHARED_MEMORY;
+            } else {
+                std::cerr << "Error: --shm requires a name and frame size "
+                             "like /frames,640x480" << std::endl;
+                ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
+            }
+        } else if (arg == "--stdin" || arg == "-stdin") {
+            read_stdin = true, stdin_delimiter = '\n';
+        } else if (arg == "--stdin0") {
+            read_stdin = true, stdin_delimiter = '\0';
+        } else if (arg[0] == '-' && arg != "-") {
             std::cerr << "Error: Unrecognized argument: " << arg << std::endl;
             ret = EXITCODE_COMMAND_LINE_USAGE_ERROR;
         } else {
-            // Arguments that will be displayed
-            if (std::filesystem::is_directory(arg)) {
-                for (auto &p : std::filesystem::directory_iterator(arg))
-                    if (std::filesystem::is_regular_file(p.path()))
-                        file_names.push_back(p.path().string());
+            inputs.push_back(arg);
+        }
+    }
+
+    // Arguments that will be displayed, resolved once all flags are known
+    for (const std::string &arg : inputs) {
+        if (arg == "-") {
+            file_names.push_back(arg);  // Read the image from stdin
+        } else if (std::filesystem::is_directory(arg) && recursive) {
+            directories.push_back(arg);
+        } else if (std::filesystem::is_directory(arg)) {
+            for (auto &p : std::filesystem::directory_iterator(arg))
+                if (std::filesystem::is_regular_file(p.path()))
+                    file_names.push_back(p.path().string());
+        } else {
+            // Check if file can be opened, without opening it twice
+#ifdef _POSIX_VERSION
+            bool readable = access(arg.c_str(), R_OK) == 0;
+#else
+            bool readable = static_cast<bool>(std::ifstream(arg.c_str()));
+#endif
+            if (readable) {
+                file_names.push_back(arg);
             } else {
-                // Check if file can be opened, @TODO find better way
-                std::ifstream fin(arg.c_str());
-                if (fin) {
-                    file_names.push_back(arg);
-                } else {
-                    std::cerr << "Error: Cannot open '" << arg
-                              << "', permission issue?" << std::endl;
-                    ret = EXITCODE_NO_INPUT_ERROR;
-                }
+                std::cerr << "Error: Cannot open '" << arg
+                          << "', permission issue?" << std::endl;
+                ret = EXITCODE_NO_INPUT_ERROR;
             }
         }
     }
 
     if (detectSize) {
 #ifdef _POSIX_VERSION
-        struct winsize w;
         // If redirecting STDOUT to one file ( col or row == 0, or the previous
         // ioctl call's failed )
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0 ||
-            (w.ws_col | w.ws_row) == 0) {
+        if (!terminalSize(maxWidth, maxHeight)) {
             std::cerr << "Warning: failed to determine most reasonable size: "
                       << strerror(errno) << ", defaulting to 20x6" << std::endl;
-        } else {
-            maxWidth = w.ws_col * 4;
-            maxHeight = w.ws_row * 8;
         }
 #elif defined _WIN32
         CONSOLE_SCREEN_BUFFER_INFO w;
@@ -361,11 +3900,197 @@ int main(int argc, char *argv[]) {
 #endif
     }
 
-    if (mode == FULL_SIZE || (mode == AUTO && file_names.size() == 1)) {
-        for (const auto &filename : file_names) {
+    if (read_stdin &&
+        std::find(file_names.begin(), file_names.end(), "-") !=
+            file_names.end()) {
+        std::cerr << "Error: Cannot read both an image and file names from "
+                     "stdin" << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+    }
+
+    if (mode == RAW_VIDEO) {
+        FrameReader reader(stdin, videoWidth, videoHeight);
+        return playVideo(reader, fps, maxWidth, maxHeight, flags, hysteresis);
+    } else if (mode == Y4M_VIDEO) {
+        FrameReader reader(stdin);
+        return playVideo(reader, fps > 0 ? fps : reader.fps(), maxWidth,
+                         maxHeight, flags, hysteresis);
+    } else if (mode == SHARED_MEMORY && !wall) {
+#ifdef _POSIX_VERSION
+        return playSharedMemory(shmName, videoWidth, videoHeight, maxWidth,
+                                maxHeight, flags, hysteresis);
+#else
+        std::cerr << "Error: --shm is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+#endif
+    }
+
+    if (threads == 0) {
+        const char *env = std::getenv("TIV_THREADS");
+        long env_threads = env ? std::strtol(env, nullptr, 10) : 0;
+        threads = env_threads > 0 ? env_threads : default_thread_count();
+    }
+
+    if (watch) {
+        if (file_names.size() != 1 || file_names[0] == "-" ||
+            !directories.empty() || read_stdin) {
+            std::cerr << "Error: --watch requires a single image file"
+                      << std::endl;
+            return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+        }
+#ifdef __linux__
+        return watchImage(file_names[0], maxWidth, maxHeight, detectSize, flags,
+                          bgColor);
+#else
+        std::cerr << "Error: --watch is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+#endif
+    }
+
+    if (explore) {
+        if (file_names.size() != 1 || !directories.empty() || read_stdin) {
+            std::cerr << "Error: --explore requires a single image file"
+                      << std::endl;
+            return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+        }
+#ifdef _POSIX_VERSION
+        return exploreImage(file_names[0], maxWidth, maxHeight, detectSize,
+                            flags, bgColor, threads);
+#else
+        std::cerr << "Error: --explore is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+#endif
+    }
+
+    if (wall) {
+        if (std::find(file_names.begin(), file_names.end(), "-") !=
+                file_names.end() ||
+            !directories.empty() || read_stdin ||
+            file_names.size() + shm_sources.size() == 0) {
+            std::cerr << "Error: --wall requires image files or --shm sources"
+                      << std::endl;
+            return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+        }
+#ifdef __linux__
+        return playWall(file_names, shm_sources, columns, maxWidth, maxHeight,
+                        flags, bgColor);
+#else
+        std::cerr << "Error: --wall is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+#endif
+    }
+
+    // File names from the command line come first, followed by the images
+    // found in directories given with -r. Those and names from stdin are only
+    // produced when the display loop asks for the next one, so rendering
+    // starts right away and memory does not grow with the length of the list.
+    std::unique_ptr<DirectoryWalker> walker;
+    // --browse follows resizes, which must not be delivered to the walker's
+    // threads.
+    if (browse && detectSize) catchResizes();
+    if (!directories.empty())
+        walker = std::make_unique<DirectoryWalker>(directories, threads);
+    // With --follow, the images arriving in a directory come last, and the
+    // thumbnail grid waits for more of them whenever it runs out.
+#ifdef __linux__
+    std::unique_ptr<DirectoryFollower> follower;
+    if (!follow.empty()) {
+        follower = std::make_unique<DirectoryFollower>(follow);
+        if (!follower->error().empty()) {
+            std::cerr << "Error: Cannot follow '" << follow
+                      << "': " << follower->error() << std::endl;
+            return EXITCODE_NO_INPUT_ERROR;
+        }
+        catchInterrupts();
+    }
+    auto wait_for_files = [&]() { return follower && follower->wait(); };
+#else
+    if (!follow.empty()) {
+        std::cerr << "Error: --follow is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+    }
+    auto wait_for_files = []() { return false; };
+#endif
+    std::unique_ptr<NameReader> stdin_names;
+    if (read_stdin) stdin_names = std::make_unique<NameReader>(stdin_delimiter);
+    // The directory walker also hands out the file it mapped for sniffing.
+    size_t next_file = 0;
+    auto next_file_name = [&](std::string &name,
+                              std::unique_ptr<FileData> &file) {
+        file.reset();
+        if (next_file < file_names.size()) {
+            name = file_names[next_file++];
+            return true;
+        }
+        if (walker && walker->next(name, file)) return true;
+        if (stdin_names && stdin_names->next(name)) return true;
+#ifdef __linux__
+        if (follower && follower->next(name, file)) return true;
+#endif
+        return false;
+    };
+    // Whether next_file_name() returns without waiting for the directory
+    // walk or for a name to be written to stdin.
+    auto file_name_ready = [&]() {
+        if (next_file < file_names.size()) return true;
+        if (walker && !walker->finished()) return walker->ready();
+        return !stdin_names || stdin_names->ready();
+    };
+
+    if (slideshow >= 0) {
+#ifdef _POSIX_VERSION
+        return playSlideshow(next_file_name, slideshow, maxWidth, maxHeight,
+                             flags, bgColor);
+#else
+        std::cerr << "Error: --slideshow is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+#endif
+    }
+
+    if (browse) {
+#ifdef _POSIX_VERSION
+        return browseThumbnails(next_file_name, columns, maxWidth, maxHeight,
+                                detectSize, flags, bgColor, threads);
+#else
+        std::cerr << "Error: --browse is not supported on this platform"
+                  << std::endl;
+        return EXITCODE_COMMAND_LINE_USAGE_ERROR;
+#endif
+    }
+
+    if (follow.empty() &&
+        (mode == FULL_SIZE ||
+         (mode == AUTO && file_names.size() == 1 && directories.empty() &&
+          !read_stdin))) {
+        std::string filename;
+        std::unique_ptr<FileData> file;
+        while (next_file_name(filename, file)) {
+            if (!output_ok() || interrupted) break;
             try {
-                cimg_library::CImg<unsigned char> image =
-                    load_rgb_CImg(filename.c_str(), bgColor);
+                if (!file) file = std::make_unique<FileData>(filename);
+                if (animate && sniff_format(file->data(), file->size()) ==
+                                   FORMAT_GIF) {
+                    GifDecoder gif(file->data(), file->size(), bgColor);
+                    if (gif.valid()) {
+                        int played = playAnimation(gif, maxWidth, maxHeight,
+                                                   flags);
+                        if (played != EXITCODE_OK) ret = played;
+                        continue;
+                    }
+                }
+                cimg_library::CImg<unsigned char> image = load_rgb_CImg(
+                    file->data(), file->size(),
+                    filename == "-" ? nullptr : filename.c_str(), bgColor);
+                if (progressive) {
+                    printProgressively(image, maxWidth, maxHeight, flags);
+                    continue;
+                }
                 if (image.width() > maxWidth || image.height() > maxHeight) {
                     // scale image down to fit terminal size
                     size new_size =
@@ -382,31 +4107,127 @@ int main(int argc, char *argv[]) {
             }
         }
     } else {  // Thumbnail mode
-        unsigned int index = 0;
         int cw = (((maxWidth / 4) - 2 * (columns - 1)) / columns);
         int tw = cw * 4;
         cimg_library::CImg<unsigned char> image(
             tw * columns + 2 * 4 * (columns - 1), tw, 1, 3);
         size maxThumbSize(tw, tw);
 
-        while (index < file_names.size()) {
-            image.fill(0);
-            int count = 0;
-            std::string sb;
-            while (index < file_names.size() && count < columns) {
-                std::string name = file_names[index++];
+        // Maps a file (unless that happened while sniffing it) and starts
+        // reading it in the background.
+        auto open_file = [](const std::string &name,
+                            std::unique_ptr<FileData> file) {
+            if (!file) file = std::make_unique<FileData>(name);
+            file->prefetch();
+            return file;
+        };
+        auto load_thumbnail =
+            [&](const std::string &name,
+                std::future<std::unique_ptr<FileData>> opened) {
+            cimg_library::CImg<unsigned char> original;
+            if (output_closed) return original;
+            std::unique_ptr<FileData> file = opened.get();
+            original = load_rgb_CImg(file->data(), file->size(),
+                                     name == "-" ? nullptr : name.c_str(),
+                                     bgColor);
+            if (output_closed) return original;
+            size newSize = size(original).fitted_within(maxThumbSize);
+            original.resize(newSize.width, newSize.height, 1, -100, 5);
+            return original;
+        };
+        // Thumbnails are decoded on up to 'threads' worker threads ahead of
+        // the row being printed, and consumed in input order. The next
+        // 'read_ahead' files are read through io_uring where available, or
+        // opened and prefetched on I/O threads, so storage latency overlaps
+        // with decoding. Only names that have
+        // arrived already are scheduled, unless 'wait' is set and nothing is
+        // being decoded, so a slow name source never holds up the images
+        // before it.
+#ifdef TIV_IO_URING
+        std::unique_ptr<ReadRing> ring;
+        if (read_ahead > 0) {
+            ring = std::make_unique<ReadRing>(read_ahead + threads + 1);
+            if (!ring->ok()) ring.reset();
+        }
+#endif
+        auto read_file = [&](const std::string &name,
+                             std::unique_ptr<FileData> file) {
+#ifdef TIV_IO_URING
+            if (ring && !file && name != "-") {
+                auto contents = ring->read(name);
+                if (contents.valid()) return contents;
+            }
+#endif
+            return std::async(std::launch::async, open_file, name,
+                              std::move(file));
+        };
+        std::deque<std::pair<std::string,
+                             std::future<std::unique_ptr<FileData>>>>
+            reads;
+        std::deque<std::pair<std::string,
+                             std::future<cimg_library::CImg<unsigned char>>>>
+            pending;
+        auto schedule = [&](bool wait) {
+            std::string name;
+            std::unique_ptr<FileData> file;
+            while (!output_closed && pending.size() < threads) {
+                std::future<std::unique_ptr<FileData>> opened;
+                if (!reads.empty()) {
+                    name = reads.front().first;
+                    opened = std::move(reads.front().second);
+                    reads.pop_front();
+                } else if ((wait && pending.empty()) || file_name_ready()) {
+                    if (!next_file_name(name, file)) break;
+                    opened = read_ahead > 0
+                                 ? read_file(name, std::move(file))
+                                 : std::async(std::launch::deferred, open_file,
+                                              name, std::move(file));
+                } else {
+                    break;
+                }
+                pending.emplace_back(
+                    name, std::async(std::launch::async, load_thumbnail, name,
+                                     std::move(opened)));
+            }
+            // Reading ahead goes no further than the names known already.
+            while (!output_closed && reads.size() < read_ahead &&
+                   file_name_ready() && next_file_name(name, file)) {
+                reads.emplace_back(name, read_file(name, std::move(file)));
+            }
+        };
+
+        // A row is printed as soon as its thumbnails are decoded. One that is
+        // not full yet is only printed once no more images are coming, and
+        // printed again over itself when more arrive with --follow. The
+        // thumbnails already in it are kept, not decoded again.
+        image.fill(0);
+        int count = 0;
+        int shown = 0;  // Lines of the current row on the screen
+        std::string sb;
+        while (output_ok()) {
+            if (pending.empty()) schedule(true);
+            if (pending.empty()) {
+                if (!wait_for_files()) break;
+                continue;
+            }
+            int added = 0;
+            while (count < columns && !output_closed) {
+                if (pending.empty()) schedule(true);
+                if (pending.empty()) break;
+                std::string name = pending.front().first;
+                auto thumbnail = std::move(pending.front().second);
+                pending.pop_front();
+                schedule(false);
                 try {
                     cimg_library::CImg<unsigned char> original =
-                        load_rgb_CImg(name.c_str(), bgColor);
+                        thumbnail.get();
                     auto cut = name.find_last_of("/");
                     sb +=
                         cut == std::string::npos ? name : name.substr(cut + 1);
-                    size newSize = size(original).fitted_within(maxThumbSize);
-                    original.resize(newSize.width, newSize.height, 1, -100, 5);
                     image.draw_image(
-                        count * (tw + 8) + (tw - newSize.width) / 2,
-                        (tw - newSize.height) / 2, 0, 0, original);
-                    count++;
+                        count * (tw + 8) + (tw - original.width()) / 2,
+                        (tw - original.height()) / 2, 0, 0, original);
+                    count++, added++;
                     unsigned int sl = count * (cw + 2);
                     sb.resize(sl - 2, ' ');
                     sb += "  ";
@@ -414,8 +4235,19 @@ int main(int argc, char *argv[]) {
                     // Probably no image; ignore.
                 }
             }
+            if (shown) {
+                if (!added) continue;
+                std::cout << "\x1b[" << shown << "A\r";
+            }
             if (count) printImage(image, flags);
-            std::cout << sb << std::endl << std::endl;
+            if (output_ok()) std::cout << sb << std::endl << std::endl;
+            shown = (count ? tw / 8 : 0) + 2;
+            if (count == columns) {
+                image.fill(0);
+                count = 0;
+                shown = 0;
+                sb.clear();
+            }
         }
     }
     return ret;
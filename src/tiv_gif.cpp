@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2017-2023, Stefan Haustein, Aaron Liu
+ *
+ *     This file is free software: you may copy, redistribute and/or modify it
+ *     under the terms of the GNU General Public License as published by the
+ *     Free Software Foundation, either version 3 of the License, or (at your
+ *     option) any later version.
+ *
+ *     This file is distributed in the hope that it will be useful, but
+ *     WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *     General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Alternatively, you may copy, redistribute and/or modify this file under
+ * the terms of the Apache License, version 2.0:
+ *
+ *     Licensed under the Apache License, Version 2.0 (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+#include "tiv_gif.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// GIF block introducers and extension labels
+constexpr unsigned char GIF_EXTENSION = 0x21;
+constexpr unsigned char GIF_IMAGE = 0x2c;
+constexpr unsigned char GIF_GRAPHIC_CONTROL = 0xf9;
+constexpr unsigned char GIF_APPLICATION = 0xff;
+
+// Frame disposal methods
+constexpr int DISPOSE_BACKGROUND = 2;
+constexpr int DISPOSE_PREVIOUS = 3;
+
+constexpr int LZW_MAX_CODES = 4096;
+
+int read16(const unsigned char *p) { return p[0] | p[1] << 8; }
+
+GifRect intersect(const GifRect &a, const GifRect &b) {
+    GifRect r;
+    r.x = std::max(a.x, b.x);
+    r.y = std::max(a.y, b.y);
+    r.width = std::max(std::min(a.x + a.width, b.x + b.width) - r.x, 0);
+    r.height = std::max(std::min(a.y + a.height, b.y + b.height) - r.y, 0);
+    return r;
+}
+
+// The smallest rectangle containing both; empty rectangles are ignored.
+GifRect bounds(const GifRect &a, const GifRect &b) {
+    if (a.width == 0 || a.height == 0) return b;
+    if (b.width == 0 || b.height == 0) return a;
+    GifRect r;
+    r.x = std::min(a.x, b.x);
+    r.y = std::min(a.y, b.y);
+    r.width = std::max(a.x + a.width, b.x + b.width) - r.x;
+    r.height = std::max(a.y + a.height, b.y + b.height) - r.y;
+    return r;
+}
+
+}  // namespace
+
+GifDecoder::GifDecoder(const unsigned char *data, size_t size,
+                       const unsigned char background[3])
+    : data_(data), size_(size) {
+    std::copy(background, background + 3, background_);
+    // Header and logical screen descriptor
+    if (size < 13 || (std::memcmp(data, "GIF87a", 6) != 0 &&
+                      std::memcmp(data, "GIF89a", 6) != 0))
+        return;
+    int packed = data[10];
+    first_block_ = 13;
+    if (packed & 0x80) {
+        palette_ = data + first_block_;
+        palette_size_ = 2 << (packed & 7);
+        first_block_ += 3 * palette_size_;
+        if (first_block_ > size) return;
+    }
+    width_ = read16(data + 6);
+    height_ = read16(data + 8);
+    canvas_.resize(3 * width_ * height_);
+    rewind();
+}
+
+void GifDecoder::rewind() {
+    pos_ = first_block_;
+    disposal_ = 0;
+    frame_ = GifRect();
+    fill(GifRect{0, 0, width_, height_});
+    blank_ = true;
+}
+
+bool GifDecoder::next() {
+    if (!valid()) return false;
+    int disposal = 0;
+    int delay = 0;
+    int transparent = -1;
+    while (pos_ < size_) {
+        unsigned char block = data_[pos_++];
+        if (block == GIF_EXTENSION && pos_ < size_) {
+            unsigned char label = data_[pos_++];
+            const unsigned char *ext = data_ + pos_;
+            size_t left = size_ - pos_;
+            if (label == GIF_GRAPHIC_CONTROL && left >= 5 && ext[0] == 4) {
+                disposal = (ext[1] >> 2) & 7;
+                delay = read16(ext + 2) * 10;
+                if (ext[1] & 1) transparent = ext[4];
+            } else if (label == GIF_APPLICATION && left >= 16 &&
+                       ext[0] == 11 &&
+                       std::memcmp(ext + 1, "NETSCAPE2.0", 11) == 0 &&
+                       ext[12] == 3 && ext[13] == 1) {
+                // The number of times to repeat the animation after
+                // playing it once
+                int loops = read16(ext + 14);
+                plays_ = loops == 0 ? 0 : loops + 1;
+            }
+            if (!skipSubBlocks()) return false;
+        } else if (block == GIF_IMAGE && pos_ + 9 <= size_) {
+            const unsigned char *desc = data_ + pos_;
+            int packed = desc[8];
+            pos_ += 9;
+            const unsigned char *palette = palette_;
+            int palette_size = palette_size_;
+            if (packed & 0x80) {
+                palette = data_ + pos_;
+                palette_size = 2 << (packed & 7);
+                pos_ += 3 * palette_size;
+                if (pos_ >= size_) return false;
+            }
+
+            dispose();
+            frame_ = GifRect{read16(desc), read16(desc + 2), read16(desc + 4),
+                             read16(desc + 6)};
+            GifRect area = intersect(frame_, GifRect{0, 0, width_, height_});
+            disposal_ = disposal;
+            if (disposal_ == DISPOSE_PREVIOUS) {
+                saved_.resize(3 * area.width * area.height);
+                for (int y = 0; y < area.height; y++) {
+                    const unsigned char *row =
+                        &canvas_[3 * ((area.y + y) * width_ + area.x)];
+                    std::copy(row, row + 3 * area.width,
+                              &saved_[3 * y * area.width]);
+                }
+            }
+            readImage(palette, palette_size, packed & 0x40, transparent);
+
+            changed_ = blank_ ? GifRect{0, 0, width_, height_}
+                              : bounds(changed_, area);
+            blank_ = false;
+            delay_ = delay;
+            return true;
+        } else {
+            break;  // The trailer, or data we can't make sense of
+        }
+    }
+    pos_ = size_;
+    return false;
+}
+
+void GifDecoder::dispose() {
+    GifRect area = intersect(frame_, GifRect{0, 0, width_, height_});
+    changed_ = GifRect();
+    if (disposal_ == DISPOSE_BACKGROUND) {
+        fill(area);
+        changed_ = area;
+    } else if (disposal_ == DISPOSE_PREVIOUS &&
+               saved_.size() == 3u * area.width * area.height) {
+        for (int y = 0; y < area.height; y++) {
+            const unsigned char *row = &saved_[3 * y * area.width];
+            std::copy(row, row + 3 * area.width,
+                      &canvas_[3 * ((area.y + y) * width_ + area.x)]);
+        }
+        changed_ = area;
+    }
+}
+
+void GifDecoder::fill(const GifRect &rect) {
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+        for (int x = rect.x; x < rect.x + rect.width; x++)
+            std::copy(background_, background_ + 3,
+                      &canvas_[3 * (y * width_ + x)]);
+    }
+}
+
+bool GifDecoder::skipSubBlocks() {
+    while (pos_ < size_) {
+        unsigned char length = data_[pos_++];
+        if (length == 0) return true;
+        pos_ += length;
+    }
+    return false;
+}
+
+void GifDecoder::readImage(const unsigned char *palette, int palette_size,
+                           bool interlaced, int transparent) {
+    int min_code_size = pos_ < size_ ? data_[pos_++] : 0;
+    if (min_code_size < 2 || min_code_size > 11 || frame_.width == 0 ||
+        frame_.height == 0) {
+        skipSubBlocks();
+        return;
+    }
+
+    // Interlaced images store every 8th row starting at row 0, then every
+    // 8th starting at row 4, every 4th starting at 2 and every 2nd at 1.
+    static constexpr int pass_start[] = {0, 4, 2, 1};
+    static constexpr int pass_step[] = {8, 8, 4, 2};
+    int pass = 0;
+    int x = 0;
+    int y = 0;
+    auto put = [&](int index) {
+        if (y >= frame_.height) return;  // Excess data
+        int cx = frame_.x + x;
+        int cy = frame_.y + y;
+        if (index != transparent && index < palette_size && cx < width_ &&
+            cy < height_) {
+            const unsigned char *color = palette + 3 * index;
+            std::copy(color, color + 3, &canvas_[3 * (cy * width_ + cx)]);
+        }
+        if (++x < frame_.width) return;
+        x = 0;
+        if (!interlaced) {
+            y++;
+            return;
+        }
+        y += pass_step[pass];
+        while (y >= frame_.height && pass < 3) y = pass_start[++pass];
+    };
+
+    // LZW codes of code_size bits are packed LSB first into sub-blocks of
+    // up to 255 bytes. Each code after the first adds the previous code's
+    // string plus one byte to the table.
+    unsigned short prefix[LZW_MAX_CODES];
+    unsigned char suffix[LZW_MAX_CODES];
+    unsigned char stack[LZW_MAX_CODES + 1];
+    int clear = 1 << min_code_size;
+    int end = clear + 1;
+    int code_size = min_code_size + 1;
+    int next_code = end + 1;
+    int prev = -1;
+    unsigned char first = 0;
+    unsigned int bits = 0;
+    int bit_count = 0;
+    size_t block_end = pos_;
+    while (true) {
+        while (bit_count < code_size) {
+            if (pos_ == block_end) {
+                if (pos_ >= size_) return;  // Truncated
+                unsigned char length = data_[pos_++];
+                if (length == 0) return;  // No end code
+                block_end = pos_ + length;
+                if (block_end > size_) {
+                    pos_ = size_;
+                    return;
+                }
+            }
+            bits |= data_[pos_++] << bit_count;
+            bit_count += 8;
+        }
+        int code = bits & ((1 << code_size) - 1);
+        bits >>= code_size;
+        bit_count -= code_size;
+
+        if (code == clear) {
+            code_size = min_code_size + 1;
+            next_code = end + 1;
+            prev = -1;
+            continue;
+        }
+        if (code == end) break;
+        int count = 0;
+        if (prev < 0) {
+            if (code > clear) break;  // Corrupt
+            stack[count++] = first = code;
+        } else {
+            if (code > next_code) break;  // Corrupt
+            int c = code;
+            if (code == next_code) {
+                stack[count++] = first;
+                c = prev;
+            }
+            while (c > end) {
+                stack[count++] = suffix[c];
+                c = prefix[c];
+            }
+            stack[count++] = first = c;
+            if (next_code < LZW_MAX_CODES) {
+                prefix[next_code] = prev;
+                suffix[next_code] = first;
+                if (++next_code == 1 << code_size && code_size < 12)
+                    code_size++;
+            }
+        }
+        prev = code;
+        while (count > 0) put(stack[--count]);
+    }
+    pos_ = block_end;
+    skipSubBlocks();
+}
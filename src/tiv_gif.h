@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017-2023, Stefan Haustein, Aaron Liu
+ *
+ *     This file is free software: you may copy, redistribute and/or modify it
+ *     under the terms of the GNU General Public License as published by the
+ *     Free Software Foundation, either version 3 of the License, or (at your
+ *     option) any later version.
+ *
+ *     This file is distributed in the hope that it will be useful, but
+ *     WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *     General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Alternatively, you may copy, redistribute and/or modify this file under
+ * the terms of the Apache License, version 2.0:
+ *
+ *     Licensed under the Apache License, Version 2.0 (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+#ifndef TIV_GIF_H_
+#define TIV_GIF_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "tiv_lib.h"
+
+/**
+ * @brief A rectangle in canvas coordinates
+ */
+struct GifRect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+/**
+ * @brief Decodes the frames of an animated GIF one at a time, compositing
+ * each onto a single reused RGB canvas.
+ *
+ * The GIF is read from memory (e.g. a mapped file) as frames are requested,
+ * so memory use does not depend on the number of frames. Transparent pixels
+ * and areas disposed to the background show the given background color.
+ */
+class GifDecoder {
+ public:
+    // Parses the header of a GIF; check valid() for the result.
+    GifDecoder(const unsigned char *data, size_t size,
+               const unsigned char background[3]);
+
+    bool valid() const { return width_ > 0 && height_ > 0; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    /**
+     * @brief Disposes the current frame as it requested and draws the next
+     * one onto the canvas
+     *
+     * @return false after the last frame, or if the data is corrupt
+     */
+    bool next();
+
+    // Starts over at the first frame with a blank canvas.
+    void rewind();
+
+    PixelView canvas() const {
+        return PixelView{canvas_.data(), width_, height_, 3 * width_};
+    }
+
+    // The part of the canvas changed by the last call to next().
+    const GifRect &changed() const { return changed_; }
+
+    // How long the current frame is to be shown, in milliseconds.
+    int delay() const { return delay_; }
+
+    // How often the animation is to be played, 0 for forever. Animations
+    // without a loop count are played once. Known after the first frame.
+    int plays() const { return plays_; }
+
+ private:
+    void readImage(const unsigned char *palette, int palette_size,
+                   bool interlaced, int transparent);
+    void dispose();
+    void fill(const GifRect &rect);
+    bool skipSubBlocks();
+
+    const unsigned char *data_;
+    size_t size_;
+    size_t pos_ = 0;
+    size_t first_block_ = 0;  // Position after the global color table
+    int width_ = 0;
+    int height_ = 0;
+    unsigned char background_[3];
+    const unsigned char *palette_ = nullptr;  // The global color table
+    int palette_size_ = 0;
+
+    std::vector<unsigned char> canvas_;
+    // The pixels under the current frame if it is disposed to the previous
+    // state; only as large as the frame.
+    std::vector<unsigned char> saved_;
+    GifRect frame_;  // The area of the current frame
+    int disposal_ = 0;
+    bool blank_ = true;  // Nothing drawn since the canvas was cleared
+    GifRect changed_;
+    int delay_ = 0;
+    int plays_ = 1;
+};
+
+#endif  // TIV_GIF_H_
@@ -37,7 +37,6 @@
 #include <bitset>
 #include <cmath>
 #include <functional>
-#include <map>
 
 const int END_MARKER = 0;
 
@@ -210,8 +209,14 @@ unsigned char get_channel(unsigned long rgb, int index) {
     return (unsigned char) ((rgb >> ((2 - index) * 8)) & 255);
 }
 
-CharData createCharData(GetPixelFunction get_pixel, int x0, int y0,
-                        int codepoint, int pattern) {
+namespace {
+
+// The kernel is templated on the pixel accessor, so that it can be inlined
+// for PixelView instead of going through a std::function for every pixel.
+
+template <typename GetPixel>
+CharData createCharDataImpl(const GetPixel &get_pixel, int x0, int y0,
+                            int codepoint, int pattern) {
     CharData result;
     result.codePoint = codepoint;
     int fg_count = 0;
@@ -248,11 +253,18 @@ CharData createCharData(GetPixelFunction get_pixel, int x0, int y0,
     return result;
 }
 
-CharData findCharData(GetPixelFunction get_pixel, int x0, int y0,
-                      const int &flags) {
+// With a previous result for the cell, its glyph is kept if its bitmap
+// matches at most 'hysteresis' pixels worse than the best one.
+template <typename GetPixel>
+CharData findCharDataImpl(const GetPixel &get_pixel, int x0, int y0,
+                          const int &flags, const CharData *previous = nullptr,
+                          int hysteresis = 0) {
     int min[3] = {255, 255, 255};
     int max[3] = {0};
-    std::map<long, int> count_per_color;
+    // Distinct colors of the cell and their number of occurrences
+    long colors[8 * 4];
+    int counts[8 * 4];
+    int color_count = 0;
 
     // Determine the minimum and maximum value for each color channel
     for (int y = 0; y < 8; y++) {
@@ -265,22 +277,38 @@ CharData findCharData(GetPixelFunction get_pixel, int x0, int y0,
                 max[i] = std::max(max[i], d);
                 color = (color << 8) | d;
             }
-            count_per_color[color]++;
+            int i = 0;
+            while (i < color_count && colors[i] != color) i++;
+            if (i == color_count) {
+                colors[color_count] = color;
+                counts[color_count++] = 0;
+            }
+            counts[i]++;
         }
     }
 
-    std::multimap<int, long> color_per_count;
-    for (auto i = count_per_color.begin(); i != count_per_color.end(); ++i) {
-        color_per_count.insert(std::pair<int, long>(i->second, i->first));
+    // Find the two most frequent colors. Ties go to the greater color value.
+    int first = -1;
+    int second = -1;
+    auto more_frequent = [&](int a, int b) {
+        return b == -1 || counts[a] > counts[b] ||
+               (counts[a] == counts[b] && colors[a] > colors[b]);
+    };
+    for (int i = 0; i < color_count; i++) {
+        if (more_frequent(i, first)) {
+            second = first;
+            first = i;
+        } else if (more_frequent(i, second)) {
+            second = i;
+        }
     }
 
-    auto iter = color_per_count.rbegin();
-    int count2 = iter->first;
-    long max_count_color_1 = iter->second;
+    int count2 = counts[first];
+    long max_count_color_1 = colors[first];
     long max_count_color_2 = max_count_color_1;
-    if ((++iter) != color_per_count.rend()) {
-        count2 += iter->first;
-        max_count_color_2 = iter->second;
+    if (second != -1) {
+        count2 += counts[second];
+        max_count_color_2 = colors[second];
     }
 
     unsigned int bits = 0;
@@ -357,6 +385,24 @@ CharData findCharData(GetPixelFunction get_pixel, int x0, int y0,
         }
     }
 
+    if (previous && previous->codePoint != codepoint) {
+        for (int i = 0; BITMAPS[i + 1] != END_MARKER; i += 3) {
+            if (static_cast<int>(BITMAPS[i + 1]) != previous->codePoint ||
+                (BITMAPS[i + 2] & flags) != BITMAPS[i + 2]) {
+                continue;
+            }
+            unsigned int pattern = BITMAPS[i];
+            int diff = (std::bitset<32>(pattern ^ bits)).count();
+            int inverted_diff = (std::bitset<32>(~pattern ^ bits)).count();
+            if (std::min(diff, inverted_diff) <= best_diff + hysteresis) {
+                best_pattern = pattern;
+                codepoint = previous->codePoint;
+                inverted = inverted_diff < diff;
+            }
+            break;
+        }
+    }
+
     if (direct) {
         CharData result;
         if (inverted) {
@@ -372,7 +418,35 @@ CharData findCharData(GetPixelFunction get_pixel, int x0, int y0,
         }
         return result;
     }
-    return createCharData(get_pixel, x0, y0, codepoint, best_pattern);
+    return createCharDataImpl(get_pixel, x0, y0, codepoint, best_pattern);
+}
+
+}  // namespace
+
+CharData createCharData(GetPixelFunction get_pixel, int x0, int y0,
+                        int codepoint, int pattern) {
+    return createCharDataImpl(get_pixel, x0, y0, codepoint, pattern);
+}
+
+CharData createCharData(const PixelView &view, int x0, int y0,
+                        int codepoint, int pattern) {
+    return createCharDataImpl(view, x0, y0, codepoint, pattern);
+}
+
+CharData findCharData(GetPixelFunction get_pixel, int x0, int y0,
+                      const int &flags) {
+    return findCharDataImpl(get_pixel, x0, y0, flags);
+}
+
+CharData findCharData(const PixelView &view, int x0, int y0,
+                      const int &flags) {
+    return findCharDataImpl(view, x0, y0, flags);
+}
+
+CharData findCharData(const PixelView &view, int x0, int y0,
+                      const int &flags, const CharData &previous,
+                      int hysteresis) {
+    return findCharDataImpl(view, x0, y0, flags, &previous, hysteresis);
 }
 
 int clamp_byte(int value) {
@@ -60,6 +60,26 @@ constexpr int GRAYSCALE_STEPS[GRAYSCALE_STEP_COUNT] = {
 */
 typedef std::function<unsigned long(int, int)> GetPixelFunction;
 
+/**
+ * @brief A read-only view of packed 8-bit RGB pixels, such as a decoded video
+ * frame or a shared memory buffer. It can be passed to the functions below
+ * instead of a GetPixelFunction, avoiding a copy of the pixels and a
+ * std::function call per pixel.
+ */
+struct PixelView {
+    const unsigned char *data;
+    int width;
+    int height;
+    int stride;  // Distance between the starts of two rows in bytes
+
+    // Returns the pixel at x, y in 0xRRGGBB format
+    unsigned long operator()(int x, int y) const {
+        const unsigned char *pixel = data + y * stride + x * 3;
+        return (static_cast<unsigned long>(pixel[0]) << 16) |
+               (static_cast<unsigned long>(pixel[1]) << 8) | pixel[2];
+    }
+};
+
 /**
 * @brief Get the value of a specific color channel for the specified pixel
 * @param rgb A pixel in 0xRRGGBB format
@@ -90,10 +110,21 @@ struct CharData {
     int codePoint;
 };
 
+inline bool operator==(const CharData &a, const CharData &b) {
+    return a.codePoint == b.codePoint && a.fgColor == b.fgColor &&
+           a.bgColor == b.bgColor;
+}
+
+inline bool operator!=(const CharData &a, const CharData &b) {
+    return !(a == b);
+}
+
 // Return a CharData struct with the given code point and corresponding averag
 // fg and bg colors.
 CharData createCharData(GetPixelFunction get_pixel, int x0, int y0,
                         int codepoint, int pattern);
+CharData createCharData(const PixelView &view, int x0, int y0,
+                        int codepoint, int pattern);
 
 /**
  * @brief Find the best character and colors
@@ -107,5 +138,21 @@ CharData createCharData(GetPixelFunction get_pixel, int x0, int y0,
  */
 CharData findCharData(GetPixelFunction get_pixel, int x0, int y0,
                       const int &flags);
+CharData findCharData(const PixelView &view, int x0, int y0,
+                      const int &flags);
+
+/**
+ * @brief Like findCharData, but for consecutive frames of a video: keeps the
+ * character the cell had in the previous frame, only updating its colors,
+ * unless the best character matches the cell's pixels better by more than
+ * 'hysteresis' pixels. This stops noise from making characters flicker
+ * between nearly equal patterns.
+ *
+ * @param previous The result for the same cell in the previous frame
+ * @param hysteresis The number of pixels, 0 to 32
+ */
+CharData findCharData(const PixelView &view, int x0, int y0,
+                      const int &flags, const CharData &previous,
+                      int hysteresis);
 
 #endif  // TIV_LIB_H_
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017-2023, Stefan Haustein, Aaron Liu
+ *
+ *     This file is free software: you may copy, redistribute and/or modify it
+ *     under the terms of the GNU General Public License as published by the
+ *     Free Software Foundation, either version 3 of the License, or (at your
+ *     option) any later version.
+ *
+ *     This file is distributed in the hope that it will be useful, but
+ *     WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *     General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Alternatively, you may copy, redistribute and/or modify this file under
+ * the terms of the Apache License, version 2.0:
+ *
+ *     Licensed under the Apache License, Version 2.0 (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+#ifndef TIV_SHM_H_
+#define TIV_SHM_H_
+
+#include <atomic>
+#include <cstdint>
+
+// Layout of the POSIX shared memory object that tiv --shm reads frames from.
+//
+// The object starts with a TivShmHeader, followed by 'slots' frames of
+// 'stride' * height bytes each, starting at TIV_SHM_DATA_OFFSET. A producer
+// writes frame n to slot n % slots and then stores n + 1 in 'sequence', so
+// readers always find the latest complete frame in slot (sequence - 1) %
+// slots. With at least two slots, the producer never writes the slot that
+// was published last. The frame size is passed to tiv on the command line.
+//
+// Readers copy a frame out of its slot, then issue an acquire fence and load
+// 'sequence' again. If the producer has published slots - 1 or more frames
+// since the one read, it may have been overwriting the slot, and the copy is
+// discarded.
+
+constexpr uint32_t TIV_SHM_MAGIC = 0x31564954;  // "TIV1" in little endian
+constexpr uint32_t TIV_SHM_FORMAT_RGB24 = 1;    // Packed 8-bit R, G, B
+constexpr uint32_t TIV_SHM_DATA_OFFSET = 64;
+
+struct TivShmHeader {
+    uint32_t magic;   // TIV_SHM_MAGIC, written before any frame is published
+    uint32_t format;  // TIV_SHM_FORMAT_RGB24
+    uint32_t stride;  // Distance between the starts of two rows in bytes
+    uint32_t slots;   // Number of frames in the ring buffer, at least 2
+    std::atomic<uint64_t> sequence;  // Number of frames published so far
+};
+
+static_assert(sizeof(TivShmHeader) <= TIV_SHM_DATA_OFFSET,
+              "Header overlaps the frame data");
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "The sequence number must be shareable between processes");
+
+#endif  // TIV_SHM_H_